@@ -0,0 +1,230 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <stdexcept>
+
+namespace comp
+{
+   struct AllocationStats
+   {
+      uint64_t allocations{ 0 };
+      uint64_t bytes{ 0 };
+      // calls the counts were taken over, zero for raw totals
+      uint64_t calls{ 0 };
+
+      double allocationsPerCall() const;
+      double bytesPerCall() const;
+   };
+
+   // Counts the heap allocations of the calling thread. Counting needs the
+   // replacement operator new and delete that an instrumented build defines
+   // by including this header after
+   //    #define COMP_DEFINE_ALLOCATION_HOOKS
+   // in exactly one translation unit; without them every count stays zero.
+   // Declared allocation-free, and checked by test/DispatchBench.cpp, are
+   // CommandArgs::getUInt and has(), FrozenMap::find and IdempotencyCache
+   // lookups. Dispatch is not: run() allocates the script, its invocations
+   // and their parsed arguments, about eight allocations for a script of
+   // one command, and parsing allocates the argument table.
+   class AllocationCounter
+   {
+   public:
+
+      // true when the hooks are linked into the program
+      static bool enabled();
+      // totals of the calling thread since it started
+      static AllocationStats current();
+
+      // Calls fn once to warm up caches and lazily built state, then
+      // iterations more times, and returns what those calls allocated
+      template<typename Fn>
+      static AllocationStats measure(Fn&& fn, size_t iterations = 1000);
+
+      // measure() for a path declared allocation-free; throws when it
+      // allocates or when the hooks are missing and nothing can be counted
+      template<typename Fn>
+      static void expectNone(const std::string& path, Fn&& fn, size_t iterations = 1000);
+
+      // called by the hooks
+      static void record(size_t bytes);
+      static void enable();
+
+   private:
+
+      static AllocationStats& counters();
+      static std::atomic<bool>& flag();
+   };
+
+   inline double AllocationStats::allocationsPerCall() const
+   {
+      return (calls > 0 ? static_cast<double>(allocations) / calls : 0.0);
+   }
+
+   inline double AllocationStats::bytesPerCall() const
+   {
+      return (calls > 0 ? static_cast<double>(bytes) / calls : 0.0);
+   }
+
+   inline bool AllocationCounter::enabled()
+   {
+      return flag().load(std::memory_order_relaxed);
+   }
+
+   inline AllocationStats AllocationCounter::current()
+   {
+      return counters();
+   }
+
+   template<typename Fn>
+   inline AllocationStats AllocationCounter::measure(Fn&& fn, size_t iterations)
+   {
+      fn();
+
+      AllocationStats before = counters();
+
+      for (size_t i = 0; i < iterations; ++i)
+         fn();
+
+      AllocationStats res = counters();
+      res.allocations -= before.allocations;
+      res.bytes -= before.bytes;
+      res.calls = iterations;
+      return res;
+   }
+
+   template<typename Fn>
+   inline void AllocationCounter::expectNone(const std::string& path, Fn&& fn, size_t iterations)
+   {
+      if (!enabled())
+         throw std::runtime_error("allocation hooks are not linked, \"" + path + "\" cannot be checked");
+
+      AllocationStats stats = measure(fn, iterations);
+
+      if (stats.allocations > 0)
+      {
+         throw std::runtime_error("\"" + path + "\" allocated " + std::to_string(stats.allocations) + " times (" +
+            std::to_string(stats.bytes) + " bytes) over " + std::to_string(stats.calls) + " calls");
+      }
+   }
+
+   inline void AllocationCounter::record(size_t bytes)
+   {
+      AllocationStats& stats = counters();
+      ++stats.allocations;
+      stats.bytes += bytes;
+   }
+
+   inline void AllocationCounter::enable()
+   {
+      flag().store(true, std::memory_order_relaxed);
+   }
+
+   inline AllocationStats& AllocationCounter::counters()
+   {
+      // constant-initialized, so reaching it from operator new never allocates
+      static thread_local AllocationStats stats;
+      return stats;
+   }
+
+   inline std::atomic<bool>& AllocationCounter::flag()
+   {
+      static std::atomic<bool> enabled{ false };
+      return enabled;
+   }
+}
+
+#ifdef COMP_DEFINE_ALLOCATION_HOOKS
+
+namespace comp
+{
+   inline void* countedAlloc(size_t size, size_t align)
+   {
+      AllocationCounter::record(size);
+
+      if (size == 0)
+         size = 1;
+
+      if (align <= alignof(std::max_align_t))
+         return std::malloc(size);
+
+      void* res = nullptr;
+      return (posix_memalign(&res, align, size) == 0 ? res : nullptr);
+   }
+
+   // kept out of line so that compilers do not pair free() with the new expressions of inlined callers
+#if defined(__GNUC__)
+   __attribute__((noinline))
+#endif
+   inline void countedFree(void* ptr) noexcept
+   {
+      std::free(ptr);
+   }
+
+   static const bool allocationHooksEnabled = (AllocationCounter::enable(), true);
+}
+
+void* operator new(std::size_t size)
+{
+   if (void* res = comp::countedAlloc(size, 0))
+      return res;
+
+   throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+   return ::operator new(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t align)
+{
+   if (void* res = comp::countedAlloc(size, static_cast<size_t>(align)))
+      return res;
+
+   throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t align)
+{
+   return ::operator new(size, align);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+   return comp::countedAlloc(size, 0);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+   return comp::countedAlloc(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+   return comp::countedAlloc(size, static_cast<size_t>(align));
+}
+
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+   return comp::countedAlloc(size, static_cast<size_t>(align));
+}
+
+void operator delete(void* ptr) noexcept { comp::countedFree(ptr); }
+void operator delete[](void* ptr) noexcept { comp::countedFree(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { comp::countedFree(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { comp::countedFree(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { comp::countedFree(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { comp::countedFree(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { comp::countedFree(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { comp::countedFree(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { comp::countedFree(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { comp::countedFree(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { comp::countedFree(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { comp::countedFree(ptr); }
+
+#endif
\ No newline at end of file
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "CommandProcessor.hpp"
+#include "Encoding.hpp"
+#include "MpmcQueue.hpp"
+
+namespace comp
+{
+   // what handle() does when the ring is full
+   enum class Overflow
+   {
+      // wait for the writer thread to make room
+      Block,
+      // discard the status
+      Drop,
+      // keep one of every sampleRate() statuses arriving at a full ring, waiting for room for it
+      Sample
+   };
+
+   // StatusHandler handing statuses to a background thread through a
+   // lock-free ring. The thread formats whatever has accumulated into one
+   // buffer and writes it with a single system call, so dispatch threads
+   // never wait for I/O. It is concurrent(), Commander calls it without
+   // serializing. Setters only take effect before the first status.
+   class AsyncStatusHandler : public StatusHandler
+   {
+   public:
+
+      using Formatter = std::function<void(const CommandStatus& stat, std::string& out)>;
+
+      // appends to the file at path
+      AsyncStatusHandler(const std::string& path, Overflow overflow = Overflow::Block, size_t capacity = 8192);
+      // writes to a descriptor owned by the caller, such as STDOUT_FILENO
+      AsyncStatusHandler(int fd, Overflow overflow = Overflow::Block, size_t capacity = 8192);
+      // writes out every pending status before returning
+      ~AsyncStatusHandler() override;
+
+      AsyncStatusHandler(const AsyncStatusHandler&) = delete;
+      AsyncStatusHandler& operator=(const AsyncStatusHandler&) = delete;
+
+      void handle(const CommandStatus& stat) override;
+      bool concurrent() const override;
+
+      AsyncStatusHandler& sampleRate(size_t rate);
+      // replaces the default "name STATUS message" lines
+      AsyncStatusHandler& formatter(const Formatter& format);
+
+      // waits until every status accepted so far has been written or lost to a failed write
+      void flush();
+      // statuses whose whole line reached the descriptor
+      size_t written() const;
+      // statuses discarded on overflow and those lost to failed writes
+      size_t dropped() const;
+
+   private:
+
+      static void line(const CommandStatus& stat, std::string& out);
+
+      void push(CommandStatus&& stat);
+      void run();
+      // returns the bytes written before an error stopped it
+      size_t write(const std::string& buffer);
+
+      static constexpr size_t BatchSize = 256;
+
+      MpmcQueue<CommandStatus> m_ring;
+      Overflow m_overflow;
+      size_t m_sampleRate{ 100 };
+      Formatter m_format{ line };
+      int m_fd;
+      bool m_ownsFd;
+      std::once_flag m_started;
+      std::thread m_thread;
+      std::atomic<bool> m_stopping{ false };
+      // bumped by producers after a push, the writer sleeps on it
+      Futex m_ready;
+      // bumped by the writer after a batch, blocked producers and flush() sleep on it
+      Futex m_space;
+      std::atomic<size_t> m_accepted{ 0 };
+      std::atomic<size_t> m_written{ 0 };
+      std::atomic<size_t> m_dropped{ 0 };
+      // accepted statuses whose write failed
+      std::atomic<size_t> m_failed{ 0 };
+      std::atomic<size_t> m_overflows{ 0 };
+   };
+
+   inline AsyncStatusHandler::AsyncStatusHandler(const std::string& path, Overflow overflow, size_t capacity) :
+      m_ring(capacity),
+      m_overflow(overflow),
+      m_fd(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)),
+      m_ownsFd(true)
+   {
+      if (m_fd < 0)
+         throw std::runtime_error("cannot open status log \"" + path + "\"");
+   }
+
+   inline AsyncStatusHandler::AsyncStatusHandler(int fd, Overflow overflow, size_t capacity) :
+      m_ring(capacity),
+      m_overflow(overflow),
+      m_fd(fd),
+      m_ownsFd(false)
+   {}
+
+   inline AsyncStatusHandler::~AsyncStatusHandler()
+   {
+      m_stopping = true;
+      m_ready.notifyAll();
+
+      if (m_thread.joinable())
+         m_thread.join();
+
+      if (m_ownsFd)
+         close(m_fd);
+   }
+
+   inline void AsyncStatusHandler::handle(const CommandStatus& stat)
+   {
+      std::call_once(m_started, [this] { m_thread = std::thread([this] { run(); }); });
+      push(CommandStatus(stat));
+   }
+
+   inline bool AsyncStatusHandler::concurrent() const
+   {
+      return true;
+   }
+
+   inline AsyncStatusHandler& AsyncStatusHandler::sampleRate(size_t rate)
+   {
+      m_sampleRate = (rate > 0 ? rate : 1);
+      return *this;
+   }
+
+   inline AsyncStatusHandler& AsyncStatusHandler::formatter(const Formatter& format)
+   {
+      m_format = format;
+      return *this;
+   }
+
+   inline void AsyncStatusHandler::flush()
+   {
+      size_t target = m_accepted.load();
+
+      for (;;)
+      {
+         uint32_t observed = m_space.value();
+
+         if (m_written.load() + m_failed.load() >= target)
+            return;
+
+         m_space.wait(observed);
+      }
+   }
+
+   inline size_t AsyncStatusHandler::written() const
+   {
+      return m_written.load(std::memory_order_relaxed);
+   }
+
+   inline size_t AsyncStatusHandler::dropped() const
+   {
+      return m_dropped.load(std::memory_order_relaxed) + m_failed.load(std::memory_order_relaxed);
+   }
+
+   inline void AsyncStatusHandler::line(const CommandStatus& stat, std::string& out)
+   {
+      out += stat.name;
+      out += ' ';
+      out += Encoding::statusName(stat.status);
+
+      if (!stat.msg.empty())
+      {
+         out += ' ';
+         out += stat.msg;
+      }
+
+      out += '\n';
+   }
+
+   inline void AsyncStatusHandler::push(CommandStatus&& stat)
+   {
+      if (!m_ring.tryPush(std::move(stat)))
+      {
+         bool wait = (m_overflow == Overflow::Block ||
+            (m_overflow == Overflow::Sample && m_overflows.fetch_add(1, std::memory_order_relaxed) % m_sampleRate == 0));
+
+         if (!wait)
+         {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+         }
+
+         for (;;)
+         {
+            uint32_t observed = m_space.value();
+
+            if (m_ring.tryPush(std::move(stat)))
+               break;
+
+            m_space.wait(observed);
+         }
+      }
+
+      m_accepted.fetch_add(1, std::memory_order_release);
+      m_ready.notifyOne();
+   }
+
+   inline void AsyncStatusHandler::run()
+   {
+      std::string buffer;
+      // end of each status in buffer
+      std::vector<size_t> ends;
+      CommandStatus stat;
+
+      for (;;)
+      {
+         uint32_t observed = m_ready.value();
+
+         while (ends.size() < BatchSize && m_ring.tryPop(stat))
+         {
+            m_format(stat, buffer);
+            ends.push_back(buffer.size());
+         }
+
+         if (!ends.empty())
+         {
+            size_t done = write(buffer);
+            // a status counts as written only once its whole line is out
+            size_t count = static_cast<size_t>(std::upper_bound(ends.begin(), ends.end(), done) - ends.begin());
+
+            m_failed.fetch_add(ends.size() - count, std::memory_order_relaxed);
+            m_written.fetch_add(count, std::memory_order_release);
+            buffer.clear();
+            ends.clear();
+            m_space.notifyAll();
+            continue;
+         }
+
+         if (m_stopping.load())
+         {
+            // statuses pushed before the stop flag was seen are still drained above
+            if (m_ring.sizeApprox() == 0)
+               return;
+
+            continue;
+         }
+
+         m_ready.wait(observed);
+      }
+   }
+
+   inline size_t AsyncStatusHandler::write(const std::string& buffer)
+   {
+      size_t done = 0;
+
+      while (done < buffer.size())
+      {
+         ssize_t count = ::write(m_fd, buffer.data() + done, buffer.size() - done);
+
+         if (count < 0 && errno == EINTR)
+            continue;
+
+         // the rest of the batch is lost, later ones still get their chance
+         if (count <= 0)
+            break;
+
+         done += static_cast<size_t>(count);
+      }
+
+      return done;
+   }
+}
\ No newline at end of file
@@ -3,13 +3,67 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <functional>
 #include <stdexcept>
 #include <sstream>
+#include <limits>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <regex>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Executor.hpp"
+#include "FrozenMap.hpp"
+#include "IdempotencyCache.hpp"
+#include "PerfCounters.hpp"
+#include "ThreadUsage.hpp"
+#include "SlowLog.hpp"
+#include "WriteAheadLog.hpp"
+
+// Static registration: the section holds pointers to the descriptors, since
+// the compiler may pad over-aligned descriptors and break the array layout.
+//    COMP_COMMAND(hello, "hello", helloCallback)
+//    COMP_COMMAND_WITH_OPTIONS(set, "set", setCallback, { "-v", 1, false })
+#if defined(__GNUC__) && defined(__ELF__)
+#define COMP_COMMAND_SECTION_SUPPORTED 1
+#define COMP_DESCRIBE_COMMAND(ident, name, callback, batchCallback, options, count) \
+   static const comp::CommandDescriptor comp_command_##ident = { name, callback, batchCallback, options, count }; \
+   __attribute__((used, section("comp_commands"))) \
+   static const comp::CommandDescriptor* const comp_command_ptr_##ident = &comp_command_##ident;
+#else
+#define COMP_DESCRIBE_COMMAND(ident, name, callback, batchCallback, options, count) \
+   static_assert(sizeof(#ident) == 0, "static command registration needs ELF linker sections");
+#endif
+
+#define COMP_COMMAND(ident, name, callback) \
+   COMP_DESCRIBE_COMMAND(ident, name, callback, nullptr, nullptr, 0)
+
+#define COMP_COMMAND_WITH_OPTIONS(ident, name, callback, ...) \
+   static const comp::OptionDescriptor comp_options_##ident[] = { __VA_ARGS__ }; \
+   COMP_DESCRIBE_COMMAND(ident, name, callback, nullptr, comp_options_##ident, \
+      sizeof(comp_options_##ident) / sizeof(comp_options_##ident[0]))
+
+#define COMP_BATCH_COMMAND_WITH_OPTIONS(ident, name, callback, ...) \
+   static const comp::OptionDescriptor comp_options_##ident[] = { __VA_ARGS__ }; \
+   COMP_DESCRIBE_COMMAND(ident, name, nullptr, callback, comp_options_##ident, \
+      sizeof(comp_options_##ident) / sizeof(comp_options_##ident[0]))
 
 namespace comp
 {
    using ArgVec = std::vector<std::string>;
+   using ArgTable = std::unordered_map<std::string, std::string>;
 
    class Option
    {
@@ -26,13 +80,87 @@ namespace comp
       Option& argSize(size_t ArgSize);
       size_t argSize() const;
 
+      struct Constraints
+      {
+         bool ranged{ false };
+         uint64_t min{ 0 };
+         uint64_t max{ 0 };
+         std::vector<std::string> choices;
+         std::string pattern;
+         std::regex regex;
+         // zero for no limit
+         size_t maxLength{ 0 };
+      };
+
+      // Constraints are checked on every value of the option while
+      // parsing, so an invalid invocation is rejected before dispatch.
+      // Copies of an option share them, the pattern is compiled once.
+      Option& range(uint64_t min, uint64_t max);
+      Option& oneOf(const std::vector<std::string>& values);
+      // ECMAScript regex the whole value must match
+      Option& pattern(const std::string& regex);
+      Option& maxLength(size_t length);
+      // nullptr for an unconstrained option
+      const Constraints* constraints() const;
+
+      // throws when value violates a constraint, number receives a ranged value
+      void validate(const std::string& value, uint64_t& number) const;
+
    private:
 
+      Constraints& constrain();
+
       std::string m_name;
       bool m_variadicSize;
       size_t m_argSize;
+      std::shared_ptr<const Constraints> m_constraints;
+   };
+
+   // Cooperative cancellation: callbacks poll cancelled() and return early.
+   // A token is cancelled explicitly, once its deadline passed, or once
+   // its parent is cancelled. Default tokens never cancel.
+   class CancellationToken
+   {
+   public:
+
+      using Clock = std::chrono::steady_clock;
+
+      CancellationToken() = default;
+      CancellationToken(Clock::time_point deadline, const CancellationToken& parent = CancellationToken());
+
+      void cancel() const;
+      bool cancelled() const;
+      // earliest deadline along the chain, max() when there is none
+      Clock::time_point deadline() const;
+
+   private:
+
+      struct State
+      {
+         std::atomic<bool> cancelled{ false };
+         Clock::time_point deadline;
+         std::shared_ptr<const State> parent;
+      };
+
+      std::shared_ptr<State> m_state;
+   };
+
+   // How consecutive invocations of one command in a script collapse
+   // before running; collapsed invocations are neither run nor reported.
+   // Invocations carrying an idempotency key never collapse.
+   enum class Coalescing
+   {
+      // every invocation runs
+      None,
+      // only the last invocation for each value of the key option runs
+      LastWriteWins,
+      // the run becomes one invocation with the union of the options, later values winning
+      Mergeable
    };
 
+   // Copies of a config share one body, so registering a command or
+   // parsing an invocation copies a pointer rather than the option table.
+   // A setter on a shared config first gives it a body of its own.
    class CommandConfig
    {
    public:
@@ -40,16 +168,94 @@ namespace comp
       CommandConfig(const std::string& name = "");
 
       void append(const Option& opt);
-      std::string name() const;
+      const std::string& name() const;
       bool has(const std::string& name) const;
       const Option& option(const std::string& name) const;
+      std::vector<Option> options() const;
+
+      // Commands sharing the value of this option never run concurrently
+      // in the executor and keep their submission order
+      CommandConfig& orderingKey(const std::string& option);
+      const std::string& orderingKey() const;
+
+      // Invocations carrying a value of this option already seen within the
+      // Commander's idempotency window are not run again, they get the
+      // status of the first run
+      CommandConfig& idempotencyKey(const std::string& option);
+      const std::string& idempotencyKey() const;
+
+      // LastWriteWins without a key option drops repeats of identical invocations
+      CommandConfig& coalesce(Coalescing mode, const std::string& key = "");
+      Coalescing coalescing() const;
+      const std::string& coalescingKey() const;
+
+      // deadline of a single invocation counted from its start, zero for none
+      CommandConfig& timeout(std::chrono::milliseconds timeout);
+      std::chrono::milliseconds timeout() const;
+
+      // parse and execution time past which an invocation goes to the slow
+      // log, zero to use the Commander's threshold
+      CommandConfig& slowThreshold(std::chrono::microseconds threshold);
+      std::chrono::microseconds slowThreshold() const;
+
+      // executor lane of scripts containing this command
+      CommandConfig& priority(Priority priority);
+      Priority priority() const;
+
+      // invocations the executor runs at the same time, zero for no limit;
+      // excess ones wait in a queue without occupying a worker
+      CommandConfig& maxConcurrency(size_t count);
+      size_t maxConcurrency() const;
+
+      struct Resource
+      {
+         std::string name;
+         Access access;
+         // name is an option whose values are the resources
+         bool derived;
+      };
+
+      // Resources the command touches; the executor only runs conflicting
+      // commands (one writer or any number of readers) one after another.
+      // This spreads commands of different scripts over the workers, those
+      // of one script always run serially.
+      CommandConfig& reads(const std::string& resource);
+      CommandConfig& writes(const std::string& resource);
+      CommandConfig& readsFrom(const std::string& option);
+      CommandConfig& writesFrom(const std::string& option);
+      const std::vector<Resource>& resources() const;
+
+      // Compiles the options into a perfect-hashed table shared by every
+      // copy of the config; any setter called afterwards throws
+      void freeze();
+      bool frozen() const;
 
    private:
 
-      std::string m_name;
-      std::unordered_map<std::string, Option> m_options;
+      struct Body
+      {
+         std::string name;
+         std::unordered_map<std::string, Option> options;
+         std::shared_ptr<const FrozenMap<Option>> frozen;
+         std::string orderingKey;
+         std::string idempotencyKey;
+         Coalescing coalescing{ Coalescing::None };
+         std::string coalescingKey;
+         std::chrono::milliseconds timeout{ 0 };
+         std::chrono::microseconds slowThreshold{ 0 };
+         Priority priority{ Priority::Bulk };
+         size_t maxConcurrency{ 0 };
+         std::vector<Resource> resources;
+      };
+
+      // throws once frozen, copies the body first while other configs share it
+      Body& mutate();
+
+      std::shared_ptr<Body> m_body;
    };
 
+   class CommandBatch;
+
    class CommandArgs
    {
    public:
@@ -72,14 +278,65 @@ namespace comp
 
       std::string command() const;
 
+      void token(const CancellationToken& token);
+      const CancellationToken& token() const;
+
    private:
 
-      bool isProperty(const std::string& val) const;
-      bool isCommand(const std::string& val) const;
-      void parse(const ArgVec& args);
+      friend class CommandBatch;
+
+      // values of ranged options converted while validating, found before the table
+      using Numbers = std::vector<std::pair<std::string, uint64_t>>;
+
+      static ArgTable parse(const ArgVec& args, const CommandConfig& config, Numbers* numbers = nullptr);
+
+      Numbers m_numbers;
+      ArgTable m_argTable;
+      CommandConfig m_config;
+      CancellationToken m_token;
+   };
+
+   // Arguments of consecutive invocations of one command, stored column-wise:
+   // every option has one value slot per invocation
+   class CommandBatch
+   {
+   public:
+
+      CommandBatch(const CommandConfig& config);
+
+      void append(const ArgVec& args);
+      size_t size() const;
+      bool empty() const;
+
+      const ArgVec& column(const std::string& name) const;
+      std::vector<uint32_t> getUIntColumn(const std::string& name) const;
+      std::vector<uint32_t> getUIntColumn(const std::string& name, uint32_t defValue) const;
+
+      std::string getString(const std::string& name, size_t index) const;
+      std::string getString(const std::string& name, size_t index, const std::string& defValue) const;
+      uint32_t getUInt(const std::string& name, size_t index) const;
+      uint32_t getUInt(const std::string& name, size_t index, uint32_t defValue) const;
+      bool has(const std::string& name, size_t index) const;
+
+      std::string command() const;
 
-      std::unordered_map<std::string, std::string> m_argTable;
+      void token(const CancellationToken& token);
+      const CancellationToken& token() const;
+
+   private:
+
+      struct Column
+      {
+         ArgVec values;
+         std::vector<bool> present;
+      };
+
+      const Column& find(const std::string& name) const;
+
+      std::unordered_map<std::string, Column> m_columns;
       CommandConfig m_config;
+      CancellationToken m_token;
+      size_t m_size{ 0 };
    };
 
    struct CommandStatus
@@ -87,10 +344,12 @@ namespace comp
       enum Status : int
       {
          ERROR,
-         OK
+         OK,
+         // the command or its script ran past a deadline
+         TIMEOUT
       };
 
-      CommandStatus(const std::string& name, Status stat = Status::OK, const std::string& msg = "");
+      CommandStatus(const std::string& name = "", Status stat = Status::OK, const std::string& msg = "");
       CommandStatus(const CommandStatus& other);
       CommandStatus(CommandStatus&& other) noexcept;
 
@@ -102,10 +361,34 @@ namespace comp
       std::string msg;
    };
 
+   // Totals of a command name over all its versions since registration
+   struct CommandStats
+   {
+      std::string name;
+      uint64_t invocations{ 0 };
+      // invocations measured by hardware counters, the counts below cover only those
+      uint64_t counted{ 0 };
+      uint64_t instructions{ 0 };
+      uint64_t cycles{ 0 };
+      uint64_t cacheMisses{ 0 };
+      uint64_t branchMisses{ 0 };
+      // invocations measured by resource accounting, the totals below cover only those
+      uint64_t accounted{ 0 };
+      std::chrono::nanoseconds wallTime{ 0 };
+      std::chrono::nanoseconds cpuTime{ 0 };
+      uint64_t voluntarySwitches{ 0 };
+      uint64_t involuntarySwitches{ 0 };
+      uint64_t minorFaults{ 0 };
+      uint64_t majorFaults{ 0 };
+   };
+
    class StatusHandler
    {
    public:
+      virtual ~StatusHandler() = default;
       virtual void handle(const CommandStatus& stat) {};
+      // true when handle() may be called from several threads at once
+      virtual bool concurrent() const { return false; }
    };
 
    class CommandCaller
@@ -115,21 +398,187 @@ namespace comp
       using Method = CommandStatus(Class::*)(const CommandArgs& args);
       using Callback = CommandStatus(*)(const CommandArgs& args);
 
+      template<typename Class>
+      using BatchMethod = CommandStatus(Class::*)(const CommandBatch& batch);
+      using BatchCallback = CommandStatus(*)(const CommandBatch& batch);
+
       CommandCaller();
 
       CommandCaller(Callback callback, const CommandConfig& config);
+      CommandCaller(BatchCallback callback, const CommandConfig& config);
 
       template<typename Object>
       CommandCaller(Object* object, Method<Object> method, const CommandConfig& config);
 
-      CommandStatus invoke(const ArgVec& args) const;
+      template<typename Object>
+      CommandCaller(Object* object, BatchMethod<Object> method, const CommandConfig& config);
+
+      CommandStatus invoke(const ArgVec& args, const CancellationToken& token = CancellationToken()) const;
+      CommandStatus invoke(const CommandArgs& args) const;
+      CommandStatus invoke(const CommandBatch& batch) const;
       const CommandConfig& config() const;
 
+      // true when the caller was registered with a batch callback
+      bool batched() const;
+
+      // freezes the config, see CommandConfig::freeze
+      void freeze();
+
    private:
 
       CommandConfig  m_config;
       Callback   m_callback{ nullptr };
       std::function<CommandStatus(const CommandArgs&)> m_invoke{ nullptr };
+      std::function<CommandStatus(const CommandBatch&)> m_batchInvoke{ nullptr };
+   };
+
+   // Constant-initialized description of a command, placed in the
+   // comp_commands linker section by COMP_COMMAND so that registering it
+   // runs no constructor and allocates nothing at startup
+   struct OptionDescriptor
+   {
+      const char* name;
+      size_t argSize;
+      bool variadicSize;
+   };
+
+   struct CommandDescriptor
+   {
+      const char* name;
+      CommandCaller::Callback callback;
+      CommandCaller::BatchCallback batchCallback;
+      const OptionDescriptor* options;
+      size_t optionCount;
+
+      CommandConfig config() const;
+      CommandCaller caller() const;
+   };
+
+   // Command set packaged as a shared object exporting
+   //    extern "C" void comp_load_commands(std::vector<comp::CommandCaller>& commands);
+   // The library is opened on the first load() and stays mapped for the
+   // lifetime of the process, since loaded callers point into its code.
+   class Plugin
+   {
+   public:
+
+      using EntryPoint = void(*)(std::vector<CommandCaller>& commands);
+      using Installer = std::function<void(const CommandCaller& caller)>;
+
+      static constexpr const char* EntryPointName = "comp_load_commands";
+
+      Plugin(const std::string& path);
+
+      Plugin(const Plugin&) = delete;
+      Plugin& operator=(const Plugin&) = delete;
+
+      // thread-safe; opens the library once and passes every command it provides to install
+      void load(const Installer& install);
+      std::string path() const;
+
+   private:
+
+      std::string m_path;
+      std::once_flag m_once;
+      std::string m_error;
+   };
+
+   // Read-only command configs mapped from a file written by write().
+   // The file holds the perfect hash layout of FrozenMap and refers to
+   // everything by offset, so opening it and finding a name cost the same
+   // for any number of commands. It is deserialized lazily per command:
+   // config() copies the record of one command into a CommandConfig,
+   // which Commander does once, when the command is first prepared, and
+   // parsing then runs on that copy. Files are tied to the byte order and
+   // layout of the platform that wrote them.
+   class Snapshot
+   {
+   public:
+
+      static constexpr size_t npos = static_cast<size_t>(-1);
+
+      Snapshot(const std::string& path);
+      ~Snapshot();
+
+      Snapshot(const Snapshot&) = delete;
+      Snapshot& operator=(const Snapshot&) = delete;
+
+      static void write(const std::string& path, const std::vector<CommandConfig>& configs);
+
+      size_t size() const;
+      // number of slots, every slot index is below it
+      size_t slots() const;
+      // slot of a command, npos if the snapshot does not have it
+      size_t find(const std::string& name) const;
+      CommandConfig config(size_t slot) const;
+      std::vector<CommandConfig> configs() const;
+
+   private:
+
+      struct Header
+      {
+         char magic[8];
+         uint32_t version;
+         uint32_t count;
+         uint32_t bucketCount;
+         uint32_t slotCount;
+         uint64_t seeds;
+         uint64_t slots;
+         uint64_t size;
+      };
+
+      struct Record
+      {
+         uint64_t name;
+         uint64_t orderingKey;
+         uint64_t idempotencyKey;
+         uint64_t coalescingKey;
+         int64_t timeout;
+         int64_t slowThreshold;
+         uint64_t maxConcurrency;
+         uint64_t options;
+         uint64_t resources;
+         uint32_t priority;
+         uint32_t optionCount;
+         uint32_t resourceCount;
+         uint32_t coalescing;
+      };
+
+      struct OptionRecord
+      {
+         uint64_t name;
+         uint64_t argSize;
+         uint32_t variadicSize;
+         uint32_t ranged;
+         uint64_t min;
+         uint64_t max;
+         uint64_t maxLength;
+         uint64_t pattern;
+         // offsets of the allowed value strings
+         uint64_t choices;
+         uint64_t choiceCount;
+      };
+
+      struct ResourceRecord
+      {
+         uint64_t name;
+         uint32_t access;
+         uint32_t derived;
+      };
+
+      static constexpr char Magic[8] = { 'C', 'O', 'M', 'P', 'S', 'N', 'A', 'P' };
+      static constexpr uint32_t Version = 5;
+
+      // bounds-checked view of count objects at offset
+      template<typename T>
+      const T* at(uint64_t offset, size_t count = 1) const;
+      std::string string(uint64_t offset) const;
+      const Record* record(size_t slot) const;
+
+      std::string m_path;
+      const char* m_data{ nullptr };
+      size_t m_size{ 0 };
+      const Header* m_header{ nullptr };
    };
 
    class Commander final
@@ -146,240 +595,823 @@ namespace comp
       void run();
       void run(const ArgVec& args);
 
+      // Registers a command; registering a new name is not safe while
+      // commands run, an existing name is swapped as by replaceCommand
       void appendCommand(const CommandCaller& caller);
-      void setHandler(const StatusHandler& handler);
+      // Atomically swaps the implementation of a registered command while
+      // commands run. Invocations already prepared, running or queued,
+      // finish on the version they were prepared with. A changed concurrency
+      // limit starts counting afresh for the new version. The swap is not
+      // lock-free: shared_ptr atomics take a short internal lock (libstdc++
+      // hashes the slot address onto a small pool of mutexes), so dispatch
+      // may wait for the pointer copy of a swap, never for the map or for
+      // building the new version.
+      void replaceCommand(const CommandCaller& caller);
+      // Registers the manifest's names and configs right away; the shared
+      // object implementing them is only opened when one of them is first
+      // prepared for execution, and its commands then replace the manifest
+      void appendPlugin(const std::string& path, const std::vector<CommandConfig>& manifest);
+      // Registers the names of every command described with COMP_COMMAND
+      // in the executable; each one is only bound to its descriptor when it
+      // is first prepared for execution. The descriptors are read in place,
+      // but the mutable registry still allocates an entry for every name.
+      void appendStaticCommands();
+      // descriptors found in the comp_commands section, empty where linker sections are unsupported
+      static std::vector<const CommandDescriptor*> staticCommands();
+      // the descriptor of a name, null if none; searches the section in place without indexing it
+      static const CommandDescriptor* staticCommand(const std::string& name);
+      // the handler is not copied and must outlive the Commander
+      void setHandler(StatusHandler& handler);
+
+      // Compiles the registry and every command config into read-only
+      // perfect-hashed tables that dispatch and parsing look names up in.
+      // Registering, replacing or reconfiguring commands afterwards throws;
+      // plugins still load lazily into their frozen slots. Not safe while
+      // commands run.
+      void freeze();
+      bool frozen() const;
+
+      // gives the implementation of a command loaded from a snapshot
+      using Binder = std::function<CommandCaller(const CommandConfig& config)>;
+
+      // Writes the names and configs of the frozen registry to a snapshot file
+      void saveSnapshot(const std::string& path) const;
+      // Freezes an empty registry onto a mapped snapshot. Startup cost does
+      // not depend on the number of commands: each one is bound on its first
+      // preparation by passing its config to the binder.
+      void loadSnapshot(const std::string& path, const Binder& binder = bindStatic);
+      // binds a snapshot config to the COMP_COMMAND callback of the same name
+      static CommandCaller bindStatic(const CommandConfig& config);
+
+      // Bounds the latency of every script passed to run() or submit(),
+      // counted from the call; zero disables it. Commands of a script past
+      // its deadline are reported as TIMEOUT without running, as are
+      // commands that return after their own or their script's deadline.
+      void setBatchTimeout(std::chrono::milliseconds timeout);
 
       CommandStatus invokeCommand(const std::string& command, const ArgVec& args);
 
+      // Counts instructions, cycles, cache misses and branch misses of every
+      // invocation with perf_event_open. Threads where the counters cannot
+      // be opened, as in many virtual machines, run their commands uncounted.
+      void setHardwareCounters(bool enabled);
+      // Records wall time, thread CPU time, context switches and page
+      // faults of every invocation. CPU time well below wall time, or many
+      // voluntary switches, mark a command that spends its time blocked.
+      void setResourceAccounting(bool enabled);
+      // safe while commands run; commands never run since registration report zeros
+      std::vector<CommandStats> stats() const;
+
+      // Invocations whose parse and execution take at least this long are
+      // captured in the slow log, unless their config sets its own
+      // threshold; zero disables it. Commands under every threshold only
+      // pay for two clock reads.
+      void setSlowThreshold(std::chrono::microseconds threshold);
+      SlowLog& slowLog();
+
+      // Appends every command to the log before it runs and its status
+      // after it returns; commands that never run are not journaled. The
+      // log is not copied and must outlive the Commander.
+      void setWriteAheadLog(WriteAheadLog& log);
+
+      // Suppresses retried commands run through run() or submit(): an
+      // invocation whose idempotency key was seen within the window gets
+      // the cached status without its callback being called. TIMEOUT and
+      // exceptions are not cached, so those retries run again. A submitted
+      // retry arriving while the first run is still in flight waits for it
+      // without a worker and reports its status, whatever it is; run()
+      // does not wait and runs it again. capacity bounds the keys
+      // remembered, zero disables it; set it before any command runs.
+      void setIdempotency(size_t capacity, std::chrono::milliseconds window);
+
+      // Starts executor threads draining the submission queue. Submitted
+      // scripts run concurrently with each other, commands within one
+      // script run serially: one after another on a single worker, in
+      // order, stopping at the first failure. The script is thus the unit
+      // of parallelism; independent commands go into separate scripts,
+      // for instance through submitBulk(). Commands whose config declares
+      // an ordering key or resources additionally wait for earlier
+      // conflicting commands of other scripts: an ordering key value is
+      // taken exclusively, declared resources as read or write locks, all
+      // granted in submission order.
+      // Scripts submitted from inside a callback stay on the worker's core
+      // unless an idle worker steals them.
+      // The handler is never called concurrently unless it is concurrent().
+      void start(size_t workers = std::thread::hardware_concurrency(), size_t capacity = 4096,
+         Placement placement = Placement::Unpinned);
+      void stop();
+      // interactive tasks a worker runs in a row before letting a bulk one through
+      void setStarvationLimit(size_t limit);
+
+      // Thread-safe; returns false when the queue is full or not started.
+      // Without an explicit priority a script takes the highest priority
+      // declared by its commands.
+      bool submit(const ArgVec& args);
+      bool submit(const ArgVec& args, Priority priority);
+      // Enqueues all scripts in one atomic operation or none of them. Each
+      // script is scheduled on its own, so non-conflicting scripts of a
+      // bulk run in parallel while the commands of each stay serial.
+      bool submitBulk(const std::vector<ArgVec>& scripts);
+      bool submitBulk(const std::vector<ArgVec>& scripts, Priority priority);
+
+      using Completion = std::function<void(std::vector<CommandStatus>& statuses)>;
+
+      // Also hands the statuses of the script to done once it finished, on
+      // the thread that ran its last command; the handler still sees each
+      // status. done is not called when the script is not accepted.
+      bool submit(const ArgVec& args, Completion done);
+
    private:
 
-      bool isCommand(const std::string& val);
+      // one version of a registered command
+      // counters of a command name, handed from each version to the next
+      struct Usage
+      {
+         void add(const PerfSample& sample);
+         void add(std::chrono::nanoseconds wallTime, const ThreadSample& sample);
+         CommandStats stats(const std::string& name) const;
+
+         std::atomic<uint64_t> invocations{ 0 };
+         std::atomic<uint64_t> counted{ 0 };
+         std::atomic<uint64_t> instructions{ 0 };
+         std::atomic<uint64_t> cycles{ 0 };
+         std::atomic<uint64_t> cacheMisses{ 0 };
+         std::atomic<uint64_t> branchMisses{ 0 };
+         std::atomic<uint64_t> accounted{ 0 };
+         // nanoseconds
+         std::atomic<uint64_t> wallTime{ 0 };
+         std::atomic<uint64_t> cpuTime{ 0 };
+         std::atomic<uint64_t> voluntarySwitches{ 0 };
+         std::atomic<uint64_t> involuntarySwitches{ 0 };
+         std::atomic<uint64_t> minorFaults{ 0 };
+         std::atomic<uint64_t> majorFaults{ 0 };
+      };
+
+      struct Registration
+      {
+         // a new name starts with fresh usage
+         Registration(const CommandCaller& caller, const std::shared_ptr<Plugin>& plugin = nullptr,
+            const std::shared_ptr<Usage>& usage = nullptr);
+
+         CommandCaller caller;
+         std::unique_ptr<Semaphore> limit;
+         // set while the command is a manifest entry of a plugin not loaded yet
+         std::shared_ptr<Plugin> plugin;
+         std::shared_ptr<Usage> usage;
+      };
+
+      struct Invocation
+      {
+         // keeps the version alive while the invocation is pending
+         std::shared_ptr<const Registration> registration;
+         const CommandCaller* caller{ nullptr };
+         ArgVec args;
+         std::unique_ptr<CommandArgs> parsed;
+         // empty for commands free to run at any time
+         std::vector<LockManager::Request> locks;
+         Semaphore* limit{ nullptr };
+         // measured only when a slow threshold applies
+         std::chrono::nanoseconds parseTime{ 0 };
+         // command name and idempotency key value, empty when there is none
+         std::string idempotencyKey;
+         // set on the invocation the script stops at
+         std::string error;
+      };
+
+      struct Script
+      {
+         std::vector<Invocation> commands;
+         size_t next{ 0 };
+         bool sequenced{ false };
+         CancellationToken token;
+         Priority priority{ Priority::Bulk };
+         // the current command was handed a concurrency permit while parked
+         bool admitted{ false };
+         // the current command is a retry and gets the status of the run it waited for
+         bool attached{ false };
+         CommandStatus result;
+         // collects the statuses when set
+         Completion done;
+         std::vector<CommandStatus> statuses;
+      };
+
+      bool isCommand(const std::string& val) const;
+      using Slot = std::shared_ptr<const Registration>;
+      // the registry entry of a name, null if unknown
+      Slot* slot(const std::string& name);
+      const Slot* slot(const std::string& name) const;
+      void checkMutable() const;
+      // bounds of the comp_commands section, both null where it is unsupported or empty
+      static void staticSection(const CommandDescriptor* const*& first, const CommandDescriptor* const*& last);
+      template<typename Fn>
+      void forEachSlot(Fn fn) const;
+      // calls invoke, which runs the given number of invocations, and accounts it to the version
+      template<typename Invoke>
+      CommandStatus measure(const Registration& version, size_t invocations, const ArgVec& args,
+         std::chrono::nanoseconds parseTime, Invoke invoke);
+      std::chrono::microseconds slowThreshold(const CommandConfig& config) const;
+      std::shared_ptr<const Registration> lookup(const std::string& name) const;
+      std::shared_ptr<const Registration> resolve(const std::string& name);
+      // fills the empty slot of a snapshot or static command
+      std::shared_ptr<const Registration> bind(const std::string& name, Slot& entry);
+      static CommandStatus unloaded(const CommandArgs& args);
+      ArgVec collect(const ArgVec& args, size_t& pos) const;
+      std::shared_ptr<Script> prepare(const ArgVec& args);
+      static void coalesce(std::vector<Invocation>& commands);
+      static ArgVec merge(const CommandConfig& config, const std::vector<Invocation>& commands, size_t first, size_t last);
+      void sequence(Script& script);
+      void execute(const std::shared_ptr<Script>& script);
+      void retire(Script& script);
+      bool enqueue(std::vector<std::shared_ptr<Script>> scripts, Priority priority);
+      void schedule(const std::shared_ptr<Script>& script);
+      void resume(std::vector<Executor::Task> continuations);
+      static CancellationToken token(const CancellationToken& script, const CommandConfig& config);
+      static CommandStatus expire(CommandStatus stat, const CancellationToken& token);
+      static std::vector<LockManager::Request> locks(const CommandConfig& config, const CommandArgs& args);
+      void report(const CommandStatus& stat);
+      void report(Script& script, const CommandStatus& stat);
+      // no-ops without a write-ahead log
+      void journal(const ArgVec& args, std::vector<uint64_t>& sequences);
+      void journal(const std::vector<uint64_t>& sequences, const CommandStatus& stat);
+      void awaitJournal(const std::vector<uint64_t>& sequences);
+      bool duplicate(const Invocation& inv, CommandStatus& stat);
+      void remember(const Invocation& inv, const CommandStatus& stat);
+      // Marks the idempotency key of the current command in flight, owner
+      // tells whether the script took it. false when the command must not
+      // run: the script is then rescheduled with the status attached, at
+      // once if it was cached meanwhile or else once the run in flight
+      // settles, and must not be touched by the caller any more.
+      bool claim(const std::shared_ptr<Script>& script, const Invocation& inv, bool& owner);
+      // hands the status of an owned key to the scripts parked on it
+      void settle(const Invocation& inv, const CommandStatus& stat);
 
       ArgVec m_args;
-      std::unordered_map<std::string, CommandCaller> m_commands;
-      StatusHandler m_handler;
+      // slots are only read and written through std::atomic_load/atomic_store,
+      // which lock briefly; those of static commands stay empty until bound
+      std::unordered_map<std::string, Slot> m_commands;
+      // replaces m_commands once frozen
+      std::unique_ptr<FrozenMap<Slot>> m_frozen;
+      // replaces m_frozen when loaded from a snapshot, slots start empty
+      std::shared_ptr<const Snapshot> m_snapshot;
+      std::unique_ptr<Slot[]> m_snapshotSlots;
+      Binder m_binder;
+      std::atomic<bool> m_hardwareCounters{ false };
+      std::atomic<bool> m_resourceAccounting{ false };
+      StatusHandler* m_handler{ nullptr };
+      std::chrono::milliseconds m_batchTimeout{ 0 };
+      std::chrono::microseconds m_slowThreshold{ 0 };
+      SlowLog m_slowLog;
+      WriteAheadLog* m_wal{ nullptr };
+      std::unique_ptr<IdempotencyCache<CommandStatus>> m_idempotency;
+      // keys whose first run has not returned yet, with the retries waiting for it
+      std::mutex m_inflightMutex;
+      std::unordered_map<std::string, std::vector<std::shared_ptr<Script>>> m_inflight;
+      size_t m_starvationLimit{ 16 };
+      std::mutex m_handlerMutex;
+      LockManager m_locks;
+      std::unique_ptr<Executor> m_executor;
    };
 
-   Option::Option(const std::string& Name) :
+   inline Option::Option(const std::string& Name) :
       m_name(Name),
       m_variadicSize(false),
       m_argSize(0)
    {}
 
-   Option& Option::name(const std::string& Name)
+   inline Option& Option::name(const std::string& Name)
    {
       m_name = Name;
       return *this;
    }
 
-   std::string Option::name() const
+   inline std::string Option::name() const
    {
       return m_name;
    }
 
-   Option& Option::variadicSize(bool variadicSize)
+   inline Option& Option::variadicSize(bool variadicSize)
    {
       m_variadicSize = variadicSize;
       return *this;
    }
 
-   bool Option::variadicSize() const
+   inline bool Option::variadicSize() const
    {
       return m_variadicSize;
    }
 
-   Option& Option::argSize(size_t ArgSize)
+   inline Option& Option::argSize(size_t ArgSize)
    {
       m_argSize = ArgSize;
       return *this;
    }
 
-   size_t Option::argSize() const
+   inline size_t Option::argSize() const
    {
       return m_argSize;
    }
 
-   CommandConfig::CommandConfig(const std::string& name) :
-      m_name(name)
-   {}
+   inline Option& Option::range(uint64_t min, uint64_t max)
+   {
+      auto& constraints = constrain();
+      constraints.ranged = true;
+      constraints.min = min;
+      constraints.max = max;
+      return *this;
+   }
+
+   inline Option& Option::oneOf(const std::vector<std::string>& values)
+   {
+      constrain().choices = values;
+      return *this;
+   }
 
-   void CommandConfig::append(const Option& opt)
+   inline Option& Option::pattern(const std::string& regex)
    {
-      m_options[opt.name()] = opt;
+      auto& constraints = constrain();
+      constraints.regex = std::regex(regex, std::regex::ECMAScript | std::regex::optimize);
+      constraints.pattern = regex;
+      return *this;
    }
 
-   std::string CommandConfig::name() const
+   inline Option& Option::maxLength(size_t length)
    {
-      return m_name;
+      constrain().maxLength = length;
+      return *this;
    }
 
-   bool CommandConfig::has(const std::string& name) const
+   inline const Option::Constraints* Option::constraints() const
    {
-      return (m_options.find(name) != m_options.end());
+      return m_constraints.get();
    }
 
-   const Option& CommandConfig::option(const std::string& name) const
+   inline void Option::validate(const std::string& value, uint64_t& number) const
    {
-      auto res = m_options.find(name);
+      if (!m_constraints)
+         return;
 
-      if (res == m_options.end())
-         throw std::runtime_error("key \"" + name + "\" not found");
+      auto const& constraints = *m_constraints;
 
-      return res->second;
+      if (constraints.maxLength > 0 && value.size() > constraints.maxLength)
+         throw std::runtime_error("value of \"" + m_name + "\" is longer than " + std::to_string(constraints.maxLength));
+
+      if (constraints.ranged)
+      {
+         number = 0;
+         bool valid = !value.empty();
+
+         for (size_t i = 0; i < value.size() && valid; ++i)
+         {
+            unsigned digit = static_cast<unsigned char>(value[i]) - '0';
+            valid = (digit < 10 && number <= (std::numeric_limits<uint64_t>::max() - digit) / 10);
+            number = number * 10 + digit;
+         }
+
+         if (!valid || number < constraints.min || number > constraints.max)
+         {
+            throw std::runtime_error("value \"" + value + "\" of \"" + m_name + "\" is not within " +
+               std::to_string(constraints.min) + ".." + std::to_string(constraints.max));
+         }
+      }
+
+      if (!constraints.choices.empty() &&
+         std::find(constraints.choices.begin(), constraints.choices.end(), value) == constraints.choices.end())
+      {
+         throw std::runtime_error("value \"" + value + "\" of \"" + m_name + "\" is not one of the allowed values");
+      }
+
+      if (!constraints.pattern.empty() && !std::regex_match(value, constraints.regex))
+         throw std::runtime_error("value \"" + value + "\" of \"" + m_name + "\" does not match \"" + constraints.pattern + "\"");
    }
 
-   CommandArgs::CommandArgs(const ArgVec& args, const CommandConfig& config) :
-      m_config(config)
+   inline Option::Constraints& Option::constrain()
    {
-      parse(args);
+      // copies made before keep the constraints they were made with
+      auto constraints = std::make_shared<Constraints>(m_constraints ? *m_constraints : Constraints());
+      m_constraints = constraints;
+      return *constraints;
    }
 
-   CommandArgs::CommandArgs(const CommandArgs& other) :
-      m_argTable(other.m_argTable),
-      m_config(other.m_config)
-   {}
+   inline CancellationToken::CancellationToken(Clock::time_point deadline, const CancellationToken& parent) :
+      m_state(std::make_shared<State>())
+   {
+      m_state->deadline = deadline;
+      m_state->parent = parent.m_state;
+   }
 
-   CommandArgs::CommandArgs(CommandArgs&& other) noexcept :
-      m_argTable(std::move(other.m_argTable)),
-      m_config(std::move(other.m_config))
-   {}
+   inline void CancellationToken::cancel() const
+   {
+      if (m_state)
+         m_state->cancelled.store(true, std::memory_order_relaxed);
+   }
 
-   CommandArgs& CommandArgs::operator=(const CommandArgs& other)
+   inline bool CancellationToken::cancelled() const
    {
-      if (this != &other)
+      if (!m_state)
+         return false;
+
+      auto now = Clock::now();
+
+      for (const State* state = m_state.get(); state; state = state->parent.get())
       {
-         m_argTable = other.m_argTable;
-         m_config = other.m_config;
+         if (state->cancelled.load(std::memory_order_relaxed) || now >= state->deadline)
+            return true;
       }
 
-      return *this;
+      return false;
    }
 
-   CommandArgs& CommandArgs::operator=(CommandArgs&& other) noexcept
+   inline CancellationToken::Clock::time_point CancellationToken::deadline() const
    {
-      if (this != &other)
-      {
-         m_argTable = std::move(other.m_argTable);
-         m_config = std::move(other.m_config);
-      }
+      auto res = Clock::time_point::max();
 
-      return *this;
+      for (const State* state = m_state.get(); state; state = state->parent.get())
+         res = std::min(res, state->deadline);
+
+      return res;
    }
 
-   ArgVec CommandArgs::getStrVec(const std::string& name, bool throwEx) const
+   inline CommandConfig::CommandConfig(const std::string& name) :
+      m_body(std::make_shared<Body>())
    {
-      auto it = m_argTable.find(name);
+      m_body->name = name;
+   }
 
-      if (it == m_argTable.end())
-      {
-         if (throwEx)
-            throw std::runtime_error("key \"" + name + "\" not found");
-         else
-            return ArgVec{};
-      }
+   inline void CommandConfig::append(const Option& opt)
+   {
+      mutate().options[opt.name()] = opt;
+   }
 
-      ArgVec res;
-      std::stringstream ss(it->second);
-      std::string val;
+   inline const std::string& CommandConfig::name() const
+   {
+      return m_body->name;
+   }
 
-      while (std::getline(ss, val, ' '))
-         res.emplace_back(std::move(val));
+   inline bool CommandConfig::has(const std::string& name) const
+   {
+      if (m_body->frozen)
+         return (m_body->frozen->find(name) != nullptr);
 
-      return res;
+      return (m_body->options.find(name) != m_body->options.end());
    }
 
-   std::string CommandArgs::getString(const std::string& name) const
+   inline const Option& CommandConfig::option(const std::string& name) const
    {
-      auto res = m_argTable.find(name);
+      if (m_body->frozen)
+      {
+         auto opt = m_body->frozen->find(name);
 
-      if (res == m_argTable.end())
+         if (!opt)
+            throw std::runtime_error("key \"" + name + "\" not found");
+
+         return *opt;
+      }
+
+      auto res = m_body->options.find(name);
+
+      if (res == m_body->options.end())
          throw std::runtime_error("key \"" + name + "\" not found");
 
       return res->second;
    }
 
-   std::string CommandArgs::getString(const std::string& name, const std::string& defValue) const
+   inline std::vector<Option> CommandConfig::options() const
    {
-      auto res = m_argTable.find(name);
+      std::vector<Option> res;
 
-      if (res == m_argTable.end())
-         return defValue;
+      if (m_body->frozen)
+      {
+         for (auto const& entry : m_body->frozen->entries())
+         {
+            if (entry.used)
+               res.push_back(entry.value);
+         }
+      }
+      else
+      {
+         for (auto const& entry : m_body->options)
+            res.push_back(entry.second);
+      }
 
-      return res->second;
+      return res;
    }
 
-   uint32_t CommandArgs::getUInt(const std::string& name) const
+   inline CommandConfig& CommandConfig::orderingKey(const std::string& option)
    {
-      auto res = m_argTable.find(name);
+      mutate().orderingKey = option;
+      return *this;
+   }
 
-      if (res == m_argTable.end())
-         throw std::runtime_error("key \"" + name + "\" not found");
+   inline const std::string& CommandConfig::orderingKey() const
+   {
+      return m_body->orderingKey;
+   }
 
-      return std::stoul(res->second);
+   inline CommandConfig& CommandConfig::idempotencyKey(const std::string& option)
+   {
+      mutate().idempotencyKey = option;
+      return *this;
    }
 
-   uint32_t CommandArgs::getUInt(const std::string& name, uint32_t defValue) const
+   inline const std::string& CommandConfig::idempotencyKey() const
    {
-      auto res = m_argTable.find(name);
+      return m_body->idempotencyKey;
+   }
 
-      if (res == m_argTable.end())
-         return defValue;
+   inline CommandConfig& CommandConfig::coalesce(Coalescing mode, const std::string& key)
+   {
+      auto& body = mutate();
+      body.coalescing = mode;
+      body.coalescingKey = key;
+      return *this;
+   }
 
-      return std::stoul(res->second);
+   inline Coalescing CommandConfig::coalescing() const
+   {
+      return m_body->coalescing;
    }
 
-   bool CommandArgs::has(const std::string& name) const
+   inline const std::string& CommandConfig::coalescingKey() const
    {
-      return (m_argTable.find(name) != m_argTable.end());
+      return m_body->coalescingKey;
    }
 
-   std::string CommandArgs::tolower(std::string& str)
+   inline CommandConfig& CommandConfig::timeout(std::chrono::milliseconds timeout)
    {
-      for (auto& ch : str)
-         ch = std::tolower(ch);
+      mutate().timeout = timeout;
+      return *this;
+   }
 
-      return str;
+   inline std::chrono::milliseconds CommandConfig::timeout() const
+   {
+      return m_body->timeout;
    }
 
-   std::string CommandArgs::command() const
+   inline CommandConfig& CommandConfig::slowThreshold(std::chrono::microseconds threshold)
    {
-      return m_config.name();
+      mutate().slowThreshold = threshold;
+      return *this;
    }
 
-   bool CommandArgs::isProperty(const std::string& val) const
+   inline std::chrono::microseconds CommandConfig::slowThreshold() const
    {
-      return m_config.has(val);
+      return m_body->slowThreshold;
    }
 
-   bool CommandArgs::isCommand(const std::string& val) const
+   inline CommandConfig& CommandConfig::priority(Priority priority)
    {
-      return val == m_config.name();
+      mutate().priority = priority;
+      return *this;
    }
 
-   void CommandArgs::parse(const ArgVec& args)
+   inline Priority CommandConfig::priority() const
    {
-      Option unk_opt("unknown");
-      unk_opt.argSize(std::numeric_limits<size_t>::max());
-      unk_opt.variadicSize(true);
+      return m_body->priority;
+   }
 
-      for (size_t i = 0; i < args.size();)
-      {
-         if (isCommand(args[i]) && !m_config.has(args[i]))
-         {
-            ++i;
-            continue;
-         }
+   inline CommandConfig& CommandConfig::maxConcurrency(size_t count)
+   {
+      mutate().maxConcurrency = count;
+      return *this;
+   }
 
-         std::string key = isProperty(args[i]) ? args[i++] : unk_opt.name();
-         size_t count = 0;
+   inline size_t CommandConfig::maxConcurrency() const
+   {
+      return m_body->maxConcurrency;
+   }
 
-         auto const& option = (m_config.has(key) ? m_config.option(key) : unk_opt);
+   inline CommandConfig& CommandConfig::reads(const std::string& resource)
+   {
+      mutate().resources.push_back({ resource, Access::Read, false });
+      return *this;
+   }
+
+   inline CommandConfig& CommandConfig::writes(const std::string& resource)
+   {
+      mutate().resources.push_back({ resource, Access::Write, false });
+      return *this;
+   }
+
+   inline CommandConfig& CommandConfig::readsFrom(const std::string& option)
+   {
+      mutate().resources.push_back({ option, Access::Read, true });
+      return *this;
+   }
+
+   inline CommandConfig& CommandConfig::writesFrom(const std::string& option)
+   {
+      mutate().resources.push_back({ option, Access::Write, true });
+      return *this;
+   }
+
+   inline const std::vector<CommandConfig::Resource>& CommandConfig::resources() const
+   {
+      return m_body->resources;
+   }
+
+   inline void CommandConfig::freeze()
+   {
+      if (m_body->frozen)
+         return;
+
+      auto& body = mutate();
+      body.frozen = std::make_shared<const FrozenMap<Option>>(body.options.begin(), body.options.end());
+      body.options.clear();
+   }
+
+   inline bool CommandConfig::frozen() const
+   {
+      return (m_body->frozen != nullptr);
+   }
+
+   inline CommandConfig::Body& CommandConfig::mutate()
+   {
+      if (m_body->frozen)
+         throw std::runtime_error("config of \"" + m_body->name + "\" is frozen");
+
+      // the other copies keep the body they share
+      if (m_body.use_count() > 1)
+         m_body = std::make_shared<Body>(*m_body);
+
+      return *m_body;
+   }
+
+   inline CommandArgs::CommandArgs(const ArgVec& args, const CommandConfig& config) :
+      m_argTable(parse(args, config, &m_numbers)),
+      m_config(config)
+   {}
+
+   inline CommandArgs::CommandArgs(const CommandArgs& other) :
+      m_numbers(other.m_numbers),
+      m_argTable(other.m_argTable),
+      m_config(other.m_config),
+      m_token(other.m_token)
+   {}
+
+   inline CommandArgs::CommandArgs(CommandArgs&& other) noexcept :
+      m_numbers(std::move(other.m_numbers)),
+      m_argTable(std::move(other.m_argTable)),
+      m_config(std::move(other.m_config)),
+      m_token(std::move(other.m_token))
+   {}
+
+   inline CommandArgs& CommandArgs::operator=(const CommandArgs& other)
+   {
+      if (this != &other)
+      {
+         m_numbers = other.m_numbers;
+         m_argTable = other.m_argTable;
+         m_config = other.m_config;
+         m_token = other.m_token;
+      }
+
+      return *this;
+   }
+
+   inline CommandArgs& CommandArgs::operator=(CommandArgs&& other) noexcept
+   {
+      if (this != &other)
+      {
+         m_numbers = std::move(other.m_numbers);
+         m_argTable = std::move(other.m_argTable);
+         m_config = std::move(other.m_config);
+         m_token = std::move(other.m_token);
+      }
+
+      return *this;
+   }
+
+   inline ArgVec CommandArgs::getStrVec(const std::string& name, bool throwEx) const
+   {
+      auto it = m_argTable.find(name);
+
+      if (it == m_argTable.end())
+      {
+         if (throwEx)
+            throw std::runtime_error("key \"" + name + "\" not found");
+         else
+            return ArgVec{};
+      }
+
+      ArgVec res;
+      std::stringstream ss(it->second);
+      std::string val;
+
+      while (std::getline(ss, val, ' '))
+         res.emplace_back(std::move(val));
+
+      return res;
+   }
+
+   inline std::string CommandArgs::getString(const std::string& name) const
+   {
+      auto res = m_argTable.find(name);
+
+      if (res == m_argTable.end())
+         throw std::runtime_error("key \"" + name + "\" not found");
+
+      return res->second;
+   }
+
+   inline std::string CommandArgs::getString(const std::string& name, const std::string& defValue) const
+   {
+      auto res = m_argTable.find(name);
+
+      if (res == m_argTable.end())
+         return defValue;
+
+      return res->second;
+   }
+
+   inline uint32_t CommandArgs::getUInt(const std::string& name) const
+   {
+      for (auto const& number : m_numbers)
+      {
+         if (number.first == name)
+            return static_cast<uint32_t>(number.second);
+      }
+
+      auto res = m_argTable.find(name);
+
+      if (res == m_argTable.end())
+         throw std::runtime_error("key \"" + name + "\" not found");
+
+      return std::stoul(res->second);
+   }
+
+   inline uint32_t CommandArgs::getUInt(const std::string& name, uint32_t defValue) const
+   {
+      for (auto const& number : m_numbers)
+      {
+         if (number.first == name)
+            return static_cast<uint32_t>(number.second);
+      }
+
+      auto res = m_argTable.find(name);
+
+      if (res == m_argTable.end())
+         return defValue;
+
+      return std::stoul(res->second);
+   }
+
+   inline bool CommandArgs::has(const std::string& name) const
+   {
+      return (m_argTable.find(name) != m_argTable.end());
+   }
+
+   inline std::string CommandArgs::tolower(std::string& str)
+   {
+      for (auto& ch : str)
+         ch = std::tolower(ch);
+
+      return str;
+   }
+
+   inline std::string CommandArgs::command() const
+   {
+      return m_config.name();
+   }
+
+   inline void CommandArgs::token(const CancellationToken& token)
+   {
+      m_token = token;
+   }
+
+   inline const CancellationToken& CommandArgs::token() const
+   {
+      return m_token;
+   }
+
+   inline ArgTable CommandArgs::parse(const ArgVec& args, const CommandConfig& config, Numbers* numbers)
+   {
+      Option unk_opt("unknown");
+      unk_opt.argSize(std::numeric_limits<size_t>::max());
+      unk_opt.variadicSize(true);
+
+      ArgTable table;
+
+      for (size_t i = 0; i < args.size();)
+      {
+         if (args[i] == config.name() && !config.has(args[i]))
+         {
+            ++i;
+            continue;
+         }
+
+         std::string key = config.has(args[i]) ? args[i++] : unk_opt.name();
+         size_t count = 0;
+
+         auto const& option = (config.has(key) ? config.option(key) : unk_opt);
          std::string val;
 
-         while (i < args.size() && !isProperty(args[i]))
+         uint64_t number = 0;
+
+         while (i < args.size() && !config.has(args[i]))
          {
             if (count < option.argSize())
             {
+               option.validate(args[i], number);
                val += args[i++] + ' ';
                ++count;
             }
@@ -395,29 +1427,182 @@ namespace comp
          if (count < option.argSize() && !option.variadicSize())
             throw std::runtime_error("not enough arguments \"" + key + "\"");
 
-         m_argTable[key] = val;
+         if (numbers && option.constraints() && option.constraints()->ranged)
+         {
+            // a repeated option keeps its last value, as the table does
+            auto cached = std::find_if(numbers->begin(), numbers->end(),
+               [&key](const std::pair<std::string, uint64_t>& entry) { return entry.first == key; });
+
+            if (cached != numbers->end())
+               numbers->erase(cached);
+
+            if (count == 1)
+               numbers->emplace_back(key, number);
+         }
+
+         table[key] = val;
+      }
+
+      return table;
+   }
+
+   inline CommandBatch::CommandBatch(const CommandConfig& config) :
+      m_config(config)
+   {}
+
+   inline void CommandBatch::append(const ArgVec& args)
+   {
+      ArgTable table = CommandArgs::parse(args, m_config);
+
+      for (auto& col : m_columns)
+      {
+         auto it = table.find(col.first);
+         bool found = (it != table.end());
+
+         col.second.values.emplace_back(found ? std::move(it->second) : std::string());
+         col.second.present.push_back(found);
+
+         if (found)
+            table.erase(it);
+      }
+
+      for (auto& entry : table)
+      {
+         Column& col = m_columns[entry.first];
+         col.values.resize(m_size);
+         col.present.resize(m_size, false);
+         col.values.emplace_back(std::move(entry.second));
+         col.present.push_back(true);
+      }
+
+      ++m_size;
+   }
+
+   inline size_t CommandBatch::size() const
+   {
+      return m_size;
+   }
+
+   inline bool CommandBatch::empty() const
+   {
+      return (m_size == 0);
+   }
+
+   inline const ArgVec& CommandBatch::column(const std::string& name) const
+   {
+      return find(name).values;
+   }
+
+   inline std::vector<uint32_t> CommandBatch::getUIntColumn(const std::string& name) const
+   {
+      auto const& col = find(name);
+      std::vector<uint32_t> res(m_size);
+
+      for (size_t i = 0; i < m_size; ++i)
+      {
+         if (!col.present[i])
+            throw std::runtime_error("key \"" + name + "\" not found");
+
+         res[i] = std::stoul(col.values[i]);
+      }
+
+      return res;
+   }
+
+   inline std::vector<uint32_t> CommandBatch::getUIntColumn(const std::string& name, uint32_t defValue) const
+   {
+      std::vector<uint32_t> res(m_size, defValue);
+      auto it = m_columns.find(name);
+
+      if (it == m_columns.end())
+         return res;
+
+      for (size_t i = 0; i < m_size; ++i)
+      {
+         if (it->second.present[i])
+            res[i] = std::stoul(it->second.values[i]);
       }
+
+      return res;
+   }
+
+   inline std::string CommandBatch::getString(const std::string& name, size_t index) const
+   {
+      if (!has(name, index))
+         throw std::runtime_error("key \"" + name + "\" not found");
+
+      return m_columns.at(name).values[index];
+   }
+
+   inline std::string CommandBatch::getString(const std::string& name, size_t index, const std::string& defValue) const
+   {
+      return (has(name, index) ? m_columns.at(name).values[index] : defValue);
+   }
+
+   inline uint32_t CommandBatch::getUInt(const std::string& name, size_t index) const
+   {
+      return std::stoul(getString(name, index));
+   }
+
+   inline uint32_t CommandBatch::getUInt(const std::string& name, size_t index, uint32_t defValue) const
+   {
+      return (has(name, index) ? std::stoul(m_columns.at(name).values[index]) : defValue);
+   }
+
+   inline bool CommandBatch::has(const std::string& name, size_t index) const
+   {
+      auto it = m_columns.find(name);
+
+      if (index >= m_size)
+         throw std::out_of_range("batch index out of range");
+
+      return (it != m_columns.end() && it->second.present[index]);
+   }
+
+   inline std::string CommandBatch::command() const
+   {
+      return m_config.name();
+   }
+
+   inline void CommandBatch::token(const CancellationToken& token)
+   {
+      m_token = token;
+   }
+
+   inline const CancellationToken& CommandBatch::token() const
+   {
+      return m_token;
+   }
+
+   inline const CommandBatch::Column& CommandBatch::find(const std::string& name) const
+   {
+      auto res = m_columns.find(name);
+
+      if (res == m_columns.end())
+         throw std::runtime_error("key \"" + name + "\" not found");
+
+      return res->second;
    }
 
-   CommandStatus::CommandStatus(const std::string& Name, Status Stat, const std::string& Msg) :
+   inline CommandStatus::CommandStatus(const std::string& Name, Status Stat, const std::string& Msg) :
       name(Name),
       status(Stat),
       msg(Msg)
    {}
 
-   CommandStatus::CommandStatus(const CommandStatus& other) :
+   inline CommandStatus::CommandStatus(const CommandStatus& other) :
       name(other.name),
       status(other.status),
       msg(other.msg)
    {}
 
-   CommandStatus::CommandStatus(CommandStatus&& other) noexcept :
+   inline CommandStatus::CommandStatus(CommandStatus&& other) noexcept :
       name(std::move(other.name)),
       status(std::exchange(other.status, CommandStatus::ERROR)),
       msg(std::move(other.msg))
    {}
 
-   CommandStatus CommandStatus::operator=(const CommandStatus& other)
+   inline CommandStatus CommandStatus::operator=(const CommandStatus& other)
    {
       if (this != &other)
       {
@@ -429,7 +1614,7 @@ namespace comp
       return *this;
    }
 
-   CommandStatus CommandStatus::operator=(CommandStatus&& other) noexcept
+   inline CommandStatus CommandStatus::operator=(CommandStatus&& other) noexcept
    {
       if (this != &other)
       {
@@ -441,69 +1626,507 @@ namespace comp
       return *this;
    }
 
-   CommandCaller::CommandCaller()
+   inline CommandCaller::CommandCaller()
    {}
 
-   CommandCaller::CommandCaller(Callback callback, const CommandConfig& config) :
+   inline CommandCaller::CommandCaller(Callback callback, const CommandConfig& config) :
       m_config{ config },
       m_callback{ callback }
    {}
 
+   inline CommandCaller::CommandCaller(BatchCallback callback, const CommandConfig& config) :
+      m_config{ config },
+      m_batchInvoke{ callback }
+   {}
+
    template<typename Object>
    inline CommandCaller::CommandCaller(Object* object, Method<Object> method, const CommandConfig& config) :
       m_config{ config },
       m_invoke{ [object, method](const CommandArgs& args) { return (object->*method)(args); } }
    {}
 
-   CommandStatus CommandCaller::invoke(const ArgVec& args) const
+   template<typename Object>
+   inline CommandCaller::CommandCaller(Object* object, BatchMethod<Object> method, const CommandConfig& config) :
+      m_config{ config },
+      m_batchInvoke{ [object, method](const CommandBatch& batch) { return (object->*method)(batch); } }
+   {}
+
+   inline CommandStatus CommandCaller::invoke(const ArgVec& args, const CancellationToken& token) const
    {
+      if (batched())
+      {
+         CommandBatch batch(m_config);
+         batch.append(args);
+         batch.token(token);
+         return m_batchInvoke(batch);
+      }
+
       CommandArgs cargs(args, m_config);
+      cargs.token(token);
       return (m_callback ? m_callback(cargs) : m_invoke(cargs));
    }
 
-   const CommandConfig& CommandCaller::config() const
+   inline CommandStatus CommandCaller::invoke(const CommandArgs& args) const
    {
-      return m_config;
+      if (batched())
+         throw std::runtime_error("command \"" + m_config.name() + "\" expects a batch");
+
+      return (m_callback ? m_callback(args) : m_invoke(args));
    }
 
-   Commander::Commander(const ArgVec& args) :
-      m_args{ args }
+   inline CommandStatus CommandCaller::invoke(const CommandBatch& batch) const
+   {
+      if (batched())
+         return m_batchInvoke(batch);
+
+      throw std::runtime_error("command \"" + m_config.name() + "\" does not accept batches");
+   }
+
+   inline bool CommandCaller::batched() const
+   {
+      return (m_batchInvoke != nullptr);
+   }
+
+   inline const CommandConfig& CommandCaller::config() const
+   {
+      return m_config;
+   }
+
+   inline void CommandCaller::freeze()
+   {
+      m_config.freeze();
+   }
+
+   inline CommandConfig CommandDescriptor::config() const
+   {
+      CommandConfig config(name);
+
+      for (size_t i = 0; i < optionCount; ++i)
+         config.append(Option(options[i].name).argSize(options[i].argSize).variadicSize(options[i].variadicSize));
+
+      return config;
+   }
+
+   inline CommandCaller CommandDescriptor::caller() const
+   {
+      if (batchCallback)
+         return CommandCaller(batchCallback, config());
+
+      return CommandCaller(callback, config());
+   }
+
+#ifdef COMP_COMMAND_SECTION_SUPPORTED
+   // bounds of the section, provided by the linker; weak so that a program without commands still links
+   extern "C" const CommandDescriptor* const __start_comp_commands[] __attribute__((weak));
+   extern "C" const CommandDescriptor* const __stop_comp_commands[] __attribute__((weak));
+#endif
+
+   inline Plugin::Plugin(const std::string& path) :
+      m_path(path)
    {}
 
-   void Commander::init(const ArgVec& args)
+   inline void Plugin::load(const Installer& install)
    {
-      m_args = args;
+      std::call_once(m_once, [this, &install]
+      {
+         void* handle = dlopen(m_path.c_str(), RTLD_NOW | RTLD_LOCAL | RTLD_NODELETE);
+
+         if (!handle)
+         {
+            m_error = dlerror();
+            return;
+         }
+
+         auto entry = reinterpret_cast<EntryPoint>(dlsym(handle, EntryPointName));
+
+         if (!entry)
+         {
+            m_error = "\"" + m_path + "\" does not export " + EntryPointName;
+            return;
+         }
+
+         std::vector<CommandCaller> commands;
+         entry(commands);
+
+         for (auto const& caller : commands)
+            install(caller);
+      });
+
+      if (!m_error.empty())
+         throw std::runtime_error("plugin load failed: " + m_error);
+   }
+
+   inline std::string Plugin::path() const
+   {
+      return m_path;
    }
 
-   void Commander::run()
+   inline Snapshot::Snapshot(const std::string& path) :
+      m_path(path)
    {
-      std::string command;
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+      if (fd < 0)
+         throw std::runtime_error("cannot open snapshot \"" + path + "\"");
+
+      struct stat info;
+
+      if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header))
+      {
+         close(fd);
+         throw std::runtime_error("snapshot \"" + path + "\" is truncated");
+      }
+
+      m_size = static_cast<size_t>(info.st_size);
+      void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+
+      if (data == MAP_FAILED)
+         throw std::runtime_error("cannot map snapshot \"" + path + "\"");
+
+      m_data = static_cast<const char*>(data);
+      m_header = reinterpret_cast<const Header*>(m_data);
+
+      bool valid = std::equal(Magic, Magic + sizeof(Magic), m_header->magic) && m_header->version == Version &&
+         m_header->size == m_size && m_header->bucketCount > 0 && m_header->slotCount > 0 &&
+         (m_header->bucketCount & (m_header->bucketCount - 1)) == 0 &&
+         (m_header->slotCount & (m_header->slotCount - 1)) == 0;
 
       try
       {
-         for (size_t i = 0; i < m_args.size(); ++i)
+         if (valid)
          {
-            if (isCommand(m_args[i]))
-            {
-               command = m_args[i];
-               ArgVec args = { command };
+            at<uint32_t>(m_header->seeds, m_header->bucketCount);
+            at<uint64_t>(m_header->slots, m_header->slotCount);
+         }
+      }
+      catch (const std::runtime_error&)
+      {
+         valid = false;
+      }
+
+      if (!valid)
+      {
+         munmap(const_cast<char*>(m_data), m_size);
+         throw std::runtime_error("snapshot \"" + path + "\" is invalid");
+      }
+   }
 
-               while (i + 1 < m_args.size() && !isCommand(m_args[i + 1]))
-                  args.emplace_back(m_args[++i]);
+   inline Snapshot::~Snapshot()
+   {
+      munmap(const_cast<char*>(m_data), m_size);
+   }
 
-               m_handler.handle(invokeCommand(command, args));
-            }
-            else
+   inline void Snapshot::write(const std::string& path, const std::vector<CommandConfig>& configs)
+   {
+      std::vector<std::pair<std::string, const CommandConfig*>> names;
+
+      for (auto const& config : configs)
+         names.emplace_back(config.name(), &config);
+
+      FrozenMap<const CommandConfig*> table(names.begin(), names.end());
+      std::string image(sizeof(Header), '\0');
+
+      // appends 8-byte aligned data and returns its offset
+      auto put = [&image](const void* data, size_t size) -> uint64_t
+      {
+         uint64_t offset = image.size();
+         image.append(static_cast<const char*>(data), size);
+         image.resize((image.size() + 7) & ~size_t(7), '\0');
+         return offset;
+      };
+
+      // length prefix followed by the characters and a terminating zero
+      auto putString = [&image](const std::string& value) -> uint64_t
+      {
+         uint64_t offset = image.size();
+         uint32_t size = static_cast<uint32_t>(value.size());
+         image.append(reinterpret_cast<const char*>(&size), sizeof(size));
+         image.append(value.c_str(), value.size() + 1);
+         image.resize((image.size() + 7) & ~size_t(7), '\0');
+         return offset;
+      };
+
+      Header header{};
+      std::copy(Magic, Magic + sizeof(Magic), header.magic);
+      header.version = Version;
+      header.count = static_cast<uint32_t>(table.size());
+      header.bucketCount = static_cast<uint32_t>(table.seeds().size());
+      header.slotCount = static_cast<uint32_t>(table.entries().size());
+      header.seeds = put(table.seeds().data(), table.seeds().size() * sizeof(uint32_t));
+
+      std::vector<uint64_t> slots(table.entries().size(), 0);
+
+      for (size_t i = 0; i < slots.size(); ++i)
+      {
+         auto const& entry = table.entries()[i];
+
+         if (!entry.used)
+            continue;
+
+         const CommandConfig& config = *entry.value;
+         std::vector<OptionRecord> options;
+         std::vector<ResourceRecord> resources;
+
+         for (auto const& opt : config.options())
+         {
+            OptionRecord option{};
+            option.name = putString(opt.name());
+            option.argSize = opt.argSize();
+            option.variadicSize = opt.variadicSize();
+
+            if (auto constraints = opt.constraints())
             {
-               m_handler.handle(CommandStatus(m_args[i], CommandStatus::ERROR, "not a command"));
-               break;
+               std::vector<uint64_t> choices;
+
+               for (auto const& choice : constraints->choices)
+                  choices.push_back(putString(choice));
+
+               option.ranged = constraints->ranged;
+               option.min = constraints->min;
+               option.max = constraints->max;
+               option.maxLength = constraints->maxLength;
+               option.pattern = putString(constraints->pattern);
+               option.choices = put(choices.data(), choices.size() * sizeof(uint64_t));
+               option.choiceCount = choices.size();
             }
+
+            options.push_back(option);
          }
+
+         for (auto const& res : config.resources())
+            resources.push_back({ putString(res.name), static_cast<uint32_t>(res.access), res.derived });
+
+         Record record{};
+         record.name = putString(config.name());
+         record.orderingKey = putString(config.orderingKey());
+         record.idempotencyKey = putString(config.idempotencyKey());
+         record.coalescingKey = putString(config.coalescingKey());
+         record.coalescing = static_cast<uint32_t>(config.coalescing());
+         record.timeout = config.timeout().count();
+         record.slowThreshold = config.slowThreshold().count();
+         record.maxConcurrency = config.maxConcurrency();
+         record.priority = static_cast<uint32_t>(config.priority());
+         record.optionCount = static_cast<uint32_t>(options.size());
+         record.options = put(options.data(), options.size() * sizeof(OptionRecord));
+         record.resourceCount = static_cast<uint32_t>(resources.size());
+         record.resources = put(resources.data(), resources.size() * sizeof(ResourceRecord));
+         slots[i] = put(&record, sizeof(record));
       }
-      catch (const std::exception& ex)
+
+      header.slots = put(slots.data(), slots.size() * sizeof(uint64_t));
+      header.size = image.size();
+      std::copy(reinterpret_cast<const char*>(&header), reinterpret_cast<const char*>(&header + 1), &image[0]);
+
+      // written aside and renamed so that processes mapping the old file never see a partial one
+      std::string temp = path + ".tmp";
+      int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+      if (fd < 0)
+         throw std::runtime_error("cannot create snapshot \"" + path + "\"");
+
+      for (size_t done = 0; done < image.size();)
+      {
+         ssize_t count = ::write(fd, image.data() + done, image.size() - done);
+
+         if (count < 0)
+         {
+            close(fd);
+            unlink(temp.c_str());
+            throw std::runtime_error("cannot write snapshot \"" + path + "\"");
+         }
+
+         done += static_cast<size_t>(count);
+      }
+
+      // the data must be on disk before the rename is, or a crash could leave an empty file behind the name
+      if (fsync(fd) != 0)
+      {
+         close(fd);
+         unlink(temp.c_str());
+         throw std::runtime_error("cannot write snapshot \"" + path + "\"");
+      }
+
+      close(fd);
+
+      if (rename(temp.c_str(), path.c_str()) != 0)
+      {
+         unlink(temp.c_str());
+         throw std::runtime_error("cannot write snapshot \"" + path + "\"");
+      }
+
+      // makes the rename itself durable
+      auto slash = path.find_last_of('/');
+      std::string dir = (slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash));
+      int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+      if (dirFd >= 0)
+      {
+         fsync(dirFd);
+         close(dirFd);
+      }
+   }
+
+   inline size_t Snapshot::size() const
+   {
+      return m_header->count;
+   }
+
+   inline size_t Snapshot::slots() const
+   {
+      return m_header->slotCount;
+   }
+
+   inline size_t Snapshot::find(const std::string& name) const
+   {
+      uint64_t hash = PerfectHash::hash(name.data(), name.size());
+      size_t slot = PerfectHash::slot(hash, at<uint32_t>(m_header->seeds), m_header->bucketCount, m_header->slotCount);
+      const Record* rec = record(slot);
+
+      if (!rec)
+         return npos;
+
+      auto size = at<uint32_t>(rec->name);
+
+      if (*size != name.size() || std::memcmp(at<char>(rec->name + sizeof(uint32_t), *size), name.data(), *size) != 0)
+         return npos;
+
+      return slot;
+   }
+
+   inline CommandConfig Snapshot::config(size_t slot) const
+   {
+      const Record* rec = (slot < slots() ? record(slot) : nullptr);
+
+      if (!rec)
+         throw std::out_of_range("snapshot slot " + std::to_string(slot) + " is empty");
+
+      CommandConfig res(string(rec->name));
+      auto options = at<OptionRecord>(rec->options, rec->optionCount);
+      auto resources = at<ResourceRecord>(rec->resources, rec->resourceCount);
+
+      for (uint32_t i = 0; i < rec->optionCount; ++i)
+      {
+         auto const& record = options[i];
+         Option option(string(record.name));
+         option.argSize(record.argSize).variadicSize(record.variadicSize != 0);
+
+         if (record.ranged)
+            option.range(record.min, record.max);
+
+         if (record.maxLength > 0)
+            option.maxLength(record.maxLength);
+
+         if (record.choiceCount > 0)
+         {
+            auto choices = at<uint64_t>(record.choices, record.choiceCount);
+            std::vector<std::string> values;
+
+            for (uint64_t j = 0; j < record.choiceCount; ++j)
+               values.push_back(string(choices[j]));
+
+            option.oneOf(values);
+         }
+
+         if (record.pattern != 0)
+         {
+            std::string pattern = string(record.pattern);
+
+            if (!pattern.empty())
+               option.pattern(pattern);
+         }
+
+         res.append(option);
+      }
+
+      for (uint32_t i = 0; i < rec->resourceCount; ++i)
+      {
+         std::string name = string(resources[i].name);
+         bool write = (static_cast<Access>(resources[i].access) == Access::Write);
+
+         if (resources[i].derived)
+         {
+            if (write)
+               res.writesFrom(name);
+            else
+               res.readsFrom(name);
+         }
+         else if (write)
+         {
+            res.writes(name);
+         }
+         else
+         {
+            res.reads(name);
+         }
+      }
+
+      res.orderingKey(string(rec->orderingKey));
+      res.idempotencyKey(string(rec->idempotencyKey));
+      res.coalesce(static_cast<Coalescing>(rec->coalescing), string(rec->coalescingKey));
+      res.timeout(std::chrono::milliseconds(rec->timeout));
+      res.slowThreshold(std::chrono::microseconds(rec->slowThreshold));
+      res.priority(static_cast<Priority>(rec->priority));
+      res.maxConcurrency(static_cast<size_t>(rec->maxConcurrency));
+      return res;
+   }
+
+   inline std::vector<CommandConfig> Snapshot::configs() const
+   {
+      std::vector<CommandConfig> res;
+
+      for (size_t slot = 0; slot < slots(); ++slot)
       {
-         m_handler.handle(CommandStatus(command, CommandStatus::ERROR, ex.what()));
+         if (record(slot))
+            res.push_back(config(slot));
       }
+
+      return res;
+   }
+
+   template<typename T>
+   inline const T* Snapshot::at(uint64_t offset, size_t count) const
+   {
+      if (offset > m_size || count > (m_size - offset) / sizeof(T) || offset % alignof(T) != 0)
+         throw std::runtime_error("snapshot \"" + m_path + "\" is corrupt");
+
+      return reinterpret_cast<const T*>(m_data + offset);
+   }
+
+   inline std::string Snapshot::string(uint64_t offset) const
+   {
+      auto size = at<uint32_t>(offset);
+      return std::string(at<char>(offset + sizeof(uint32_t), *size), *size);
+   }
+
+   inline const Snapshot::Record* Snapshot::record(size_t slot) const
+   {
+      uint64_t offset = at<uint64_t>(m_header->slots, m_header->slotCount)[slot];
+      return (offset != 0 ? at<Record>(offset) : nullptr);
+   }
+
+   inline Commander::Registration::Registration(const CommandCaller& Caller, const std::shared_ptr<Plugin>& Source,
+      const std::shared_ptr<Usage>& Counters) :
+      caller(Caller),
+      plugin(Source),
+      usage(Counters ? Counters : std::make_shared<Usage>())
+   {
+      if (caller.config().maxConcurrency() > 0)
+         limit.reset(new Semaphore(caller.config().maxConcurrency()));
+   }
+
+   inline Commander::Commander(const ArgVec& args) :
+      m_args{ args }
+   {}
+
+   inline void Commander::init(const ArgVec& args)
+   {
+      m_args = args;
+   }
+
+   inline void Commander::run()
+   {
+      execute(prepare(m_args));
    }
 
    inline void Commander::run(const ArgVec& args)
@@ -512,23 +2135,1200 @@ namespace comp
       run();
    }
 
-   void Commander::appendCommand(const CommandCaller& caller)
+   inline void Commander::appendCommand(const CommandCaller& caller)
+   {
+      checkMutable();
+
+      auto const& name = caller.config().name();
+
+      if (m_commands.find(name) != m_commands.end())
+         replaceCommand(caller);
+      else
+         m_commands.emplace(name, std::make_shared<const Registration>(caller));
+   }
+
+   inline void Commander::replaceCommand(const CommandCaller& caller)
+   {
+      checkMutable();
+
+      auto entry = slot(caller.config().name());
+
+      if (!entry)
+         throw std::runtime_error("command \"" + caller.config().name() + "\" is not registered");
+
+      auto previous = std::atomic_load(entry);
+      std::shared_ptr<const Registration> version = std::make_shared<const Registration>(caller, nullptr,
+         previous ? previous->usage : nullptr);
+      std::atomic_store(entry, version);
+   }
+
+   inline CommandStatus Commander::invokeCommand(const std::string& command, const ArgVec& args)
+   {
+      auto version = resolve(command);
+
+      if (!version)
+         throw std::out_of_range("command \"" + command + "\" is not registered");
+
+      std::vector<uint64_t> journaled;
+      journal(args, journaled);
+      awaitJournal(journaled);
+
+      try
+      {
+         CommandStatus stat = measure(*version, 1, args, std::chrono::nanoseconds(0),
+            [&version, &args] { return version->caller.invoke(args); });
+         journal(journaled, stat);
+         return stat;
+      }
+      catch (const std::exception& ex)
+      {
+         journal(journaled, CommandStatus(command, CommandStatus::ERROR, ex.what()));
+         throw;
+      }
+   }
+
+   inline void Commander::setHardwareCounters(bool enabled)
+   {
+      m_hardwareCounters = enabled;
+   }
+
+   inline void Commander::setResourceAccounting(bool enabled)
+   {
+      m_resourceAccounting = enabled;
+   }
+
+   inline void Commander::setSlowThreshold(std::chrono::microseconds threshold)
+   {
+      m_slowThreshold = threshold;
+   }
+
+   inline SlowLog& Commander::slowLog()
+   {
+      return m_slowLog;
+   }
+
+   inline void Commander::setWriteAheadLog(WriteAheadLog& log)
+   {
+      m_wal = &log;
+   }
+
+   inline void Commander::setIdempotency(size_t capacity, std::chrono::milliseconds window)
+   {
+      m_idempotency.reset(capacity > 0 ? new IdempotencyCache<CommandStatus>(capacity, window) : nullptr);
+   }
+
+   inline std::vector<CommandStats> Commander::stats() const
    {
-      m_commands[caller.config().name()] = caller;
+      std::vector<CommandStats> res;
+
+      forEachSlot([&res](const Slot& entry)
+      {
+         auto version = std::atomic_load(&entry);
+
+         if (version)
+            res.push_back(version->usage->stats(version->caller.config().name()));
+      });
+
+      return res;
+   }
+
+   inline void Commander::appendPlugin(const std::string& path, const std::vector<CommandConfig>& manifest)
+   {
+      checkMutable();
+
+      auto plugin = std::make_shared<Plugin>(path);
+
+      for (auto const& config : manifest)
+      {
+         auto it = m_commands.find(config.name());
+
+         if (it != m_commands.end())
+         {
+            auto previous = std::atomic_load(&it->second);
+            std::atomic_store(&it->second, std::make_shared<const Registration>(CommandCaller(unloaded, config), plugin,
+               previous ? previous->usage : nullptr));
+         }
+         else
+         {
+            m_commands.emplace(config.name(), std::make_shared<const Registration>(CommandCaller(unloaded, config), plugin));
+         }
+      }
+   }
+
+   inline void Commander::appendStaticCommands()
+   {
+      checkMutable();
+
+      const CommandDescriptor* const* first;
+      const CommandDescriptor* const* last;
+      staticSection(first, last);
+
+      for (; first != last; ++first)
+      {
+         auto it = m_commands.find((*first)->name);
+
+         if (it == m_commands.end())
+            m_commands.emplace((*first)->name, nullptr);
+         else
+            replaceCommand((*first)->caller());
+      }
    }
 
-   CommandStatus Commander::invokeCommand(const std::string& command, const ArgVec& args)
+   inline std::vector<const CommandDescriptor*> Commander::staticCommands()
    {
-      return m_commands.at(command).invoke(args);
+      const CommandDescriptor* const* first;
+      const CommandDescriptor* const* last;
+      staticSection(first, last);
+      return std::vector<const CommandDescriptor*>(first, last);
    }
 
-   void Commander::setHandler(const StatusHandler& handler)
+   inline const CommandDescriptor* Commander::staticCommand(const std::string& name)
    {
-      m_handler = handler;
+      const CommandDescriptor* const* first;
+      const CommandDescriptor* const* last;
+      staticSection(first, last);
+
+      // the last descriptor of a name wins, as appendStaticCommands() keeps it;
+      // only called when a command is first bound, so a linear search will do
+      while (last != first)
+      {
+         --last;
+
+         if (name == (*last)->name)
+            return *last;
+      }
+
+      return nullptr;
    }
 
-   bool Commander::isCommand(const std::string& val)
+   inline void Commander::staticSection(const CommandDescriptor* const*& first, const CommandDescriptor* const*& last)
    {
-      return (m_commands.find(val) != m_commands.end());
+      first = nullptr;
+      last = nullptr;
+
+#ifdef COMP_COMMAND_SECTION_SUPPORTED
+      if (__start_comp_commands && __stop_comp_commands)
+      {
+         first = __start_comp_commands;
+         last = __stop_comp_commands;
+      }
+#endif
+   }
+
+   inline void Commander::setHandler(StatusHandler& handler)
+   {
+      m_handler = &handler;
+   }
+
+   inline void Commander::freeze()
+   {
+      if (m_frozen)
+         return;
+
+      std::vector<std::pair<std::string, Slot>> entries;
+
+      for (auto const& entry : m_commands)
+      {
+         auto version = std::atomic_load(&entry.second);
+
+         // static commands not bound yet are bound to frozen callers later
+         if (!version)
+         {
+            entries.emplace_back(entry.first, nullptr);
+            continue;
+         }
+
+         CommandCaller caller = version->caller;
+         caller.freeze();
+         entries.emplace_back(entry.first, std::make_shared<const Registration>(caller, version->plugin, version->usage));
+      }
+
+      m_frozen.reset(new FrozenMap<Slot>(entries.begin(), entries.end()));
+      m_commands.clear();
+   }
+
+   inline bool Commander::frozen() const
+   {
+      return (m_frozen != nullptr);
+   }
+
+   inline void Commander::saveSnapshot(const std::string& path) const
+   {
+      if (!m_frozen)
+         throw std::runtime_error("only a frozen registry can be saved");
+
+      if (m_snapshot)
+      {
+         Snapshot::write(path, m_snapshot->configs());
+         return;
+      }
+
+      std::vector<CommandConfig> configs;
+
+      for (auto const& entry : m_frozen->entries())
+      {
+         if (!entry.used)
+            continue;
+
+         auto version = std::atomic_load(&entry.value);
+         configs.push_back(version ? version->caller.config() : staticCommand(entry.key)->config());
+      }
+
+      Snapshot::write(path, configs);
+   }
+
+   inline void Commander::loadSnapshot(const std::string& path, const Binder& binder)
+   {
+      checkMutable();
+
+      if (!m_commands.empty())
+         throw std::runtime_error("a snapshot can only be loaded into an empty registry");
+
+      m_snapshot = std::make_shared<const Snapshot>(path);
+      m_snapshotSlots.reset(new Slot[m_snapshot->slots()]);
+      m_binder = binder;
+      m_frozen.reset(new FrozenMap<Slot>());
+   }
+
+   inline CommandCaller Commander::bindStatic(const CommandConfig& config)
+   {
+      auto descriptor = staticCommand(config.name());
+
+      if (!descriptor)
+         throw std::runtime_error("command \"" + config.name() + "\" has no static implementation");
+
+      if (descriptor->batchCallback)
+         return CommandCaller(descriptor->batchCallback, config);
+
+      return CommandCaller(descriptor->callback, config);
+   }
+
+   inline void Commander::setBatchTimeout(std::chrono::milliseconds timeout)
+   {
+      m_batchTimeout = timeout;
+   }
+
+   inline void Commander::start(size_t workers, size_t capacity, Placement placement)
+   {
+      stop();
+      m_executor.reset(new Executor(capacity));
+      m_executor->starvationLimit(m_starvationLimit);
+      m_executor->start(workers, placement);
+   }
+
+   inline void Commander::setStarvationLimit(size_t limit)
+   {
+      m_starvationLimit = limit;
+
+      if (m_executor)
+         m_executor->starvationLimit(limit);
+   }
+
+   inline void Commander::stop()
+   {
+      if (m_executor)
+         m_executor->stop();
+
+      m_executor.reset();
+   }
+
+   inline bool Commander::submit(const ArgVec& args)
+   {
+      if (!m_executor)
+         return false;
+
+      auto script = prepare(args);
+      return enqueue({ script }, script->priority);
+   }
+
+   inline bool Commander::submit(const ArgVec& args, Priority priority)
+   {
+      if (!m_executor)
+         return false;
+
+      return enqueue({ prepare(args) }, priority);
+   }
+
+   inline bool Commander::submit(const ArgVec& args, Completion done)
+   {
+      if (!m_executor)
+         return false;
+
+      auto script = prepare(args);
+      script->done = std::move(done);
+      return enqueue({ script }, script->priority);
+   }
+
+   inline bool Commander::submitBulk(const std::vector<ArgVec>& scripts)
+   {
+      if (!m_executor)
+         return false;
+
+      std::vector<std::shared_ptr<Script>> prepared;
+      Priority priority = Priority::Bulk;
+      prepared.reserve(scripts.size());
+
+      for (auto const& args : scripts)
+      {
+         prepared.emplace_back(prepare(args));
+         priority = std::max(priority, prepared.back()->priority);
+      }
+
+      return enqueue(std::move(prepared), priority);
+   }
+
+   inline bool Commander::submitBulk(const std::vector<ArgVec>& scripts, Priority priority)
+   {
+      if (!m_executor)
+         return false;
+
+      std::vector<std::shared_ptr<Script>> prepared;
+      prepared.reserve(scripts.size());
+
+      for (auto const& args : scripts)
+         prepared.emplace_back(prepare(args));
+
+      return enqueue(std::move(prepared), priority);
+   }
+
+   inline bool Commander::enqueue(std::vector<std::shared_ptr<Script>> scripts, Priority priority)
+   {
+      std::vector<Executor::Task> tasks;
+      tasks.reserve(scripts.size());
+
+      for (auto& script : scripts)
+      {
+         // continuations released by the lock manager keep the lane
+         script->priority = priority;
+         sequence(*script);
+         tasks.emplace_back([this, script] { execute(script); });
+      }
+
+      if (m_executor->post(tasks, priority))
+         return true;
+
+      for (auto& script : scripts)
+         retire(*script);
+
+      return false;
+   }
+
+   inline bool Commander::isCommand(const std::string& val) const
+   {
+      return (slot(val) != nullptr);
+   }
+
+   inline Commander::Slot* Commander::slot(const std::string& name)
+   {
+      return const_cast<Slot*>(static_cast<const Commander&>(*this).slot(name));
+   }
+
+   inline const Commander::Slot* Commander::slot(const std::string& name) const
+   {
+      if (m_snapshot)
+      {
+         size_t index = m_snapshot->find(name);
+         return (index != Snapshot::npos ? &m_snapshotSlots[index] : nullptr);
+      }
+
+      if (m_frozen)
+         return m_frozen->find(name);
+
+      auto it = m_commands.find(name);
+      return (it != m_commands.end() ? &it->second : nullptr);
+   }
+
+   inline void Commander::checkMutable() const
+   {
+      if (m_frozen)
+         throw std::runtime_error("command registry is frozen");
+   }
+
+   template<typename Fn>
+   inline void Commander::forEachSlot(Fn fn) const
+   {
+      if (m_snapshot)
+      {
+         for (size_t i = 0; i < m_snapshot->slots(); ++i)
+            fn(m_snapshotSlots[i]);
+      }
+      else if (m_frozen)
+      {
+         for (auto const& entry : m_frozen->entries())
+         {
+            if (entry.used)
+               fn(entry.value);
+         }
+      }
+      else
+      {
+         for (auto const& entry : m_commands)
+            fn(entry.second);
+      }
+   }
+
+   template<typename Invoke>
+   inline CommandStatus Commander::measure(const Registration& version, size_t invocations, const ArgVec& args,
+      std::chrono::nanoseconds parseTime, Invoke invoke)
+   {
+      Usage& usage = *version.usage;
+      usage.invocations.fetch_add(invocations, std::memory_order_relaxed);
+
+      ThreadSample threadBefore;
+      PerfSample perfBefore;
+      auto threshold = slowThreshold(version.caller.config());
+      bool accounting = (m_resourceAccounting.load(std::memory_order_relaxed) && ThreadUsage::read(threadBefore));
+      bool timing = (accounting || threshold.count() > 0);
+      auto start = (timing ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point());
+      // sampled closest to the call so that the accounting reads are not counted
+      bool counting = (m_hardwareCounters.load(std::memory_order_relaxed) && PerfCounters::local().read(perfBefore));
+
+      if (!timing && !counting)
+         return invoke();
+
+      CommandStatus res = invoke();
+      PerfSample perfAfter;
+      ThreadSample threadAfter;
+
+      if (counting && PerfCounters::local().read(perfAfter))
+         usage.add(perfAfter - perfBefore);
+
+      if (!timing)
+         return res;
+
+      std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+
+      if (accounting && ThreadUsage::read(threadAfter))
+         usage.add(elapsed, threadAfter - threadBefore);
+
+      if (threshold.count() > 0 && parseTime + elapsed >= threshold)
+      {
+         m_slowLog.record({ version.caller.config().name(), args, parseTime, elapsed, std::this_thread::get_id(),
+            std::chrono::system_clock::now(), invocations });
+      }
+
+      return res;
+   }
+
+   inline std::chrono::microseconds Commander::slowThreshold(const CommandConfig& config) const
+   {
+      return (config.slowThreshold().count() > 0 ? config.slowThreshold() : m_slowThreshold);
+   }
+
+   inline void Commander::Usage::add(const PerfSample& sample)
+   {
+      counted.fetch_add(1, std::memory_order_relaxed);
+      instructions.fetch_add(sample.instructions, std::memory_order_relaxed);
+      cycles.fetch_add(sample.cycles, std::memory_order_relaxed);
+      cacheMisses.fetch_add(sample.cacheMisses, std::memory_order_relaxed);
+      branchMisses.fetch_add(sample.branchMisses, std::memory_order_relaxed);
+   }
+
+   inline void Commander::Usage::add(std::chrono::nanoseconds wall, const ThreadSample& sample)
+   {
+      accounted.fetch_add(1, std::memory_order_relaxed);
+      wallTime.fetch_add(static_cast<uint64_t>(wall.count()), std::memory_order_relaxed);
+      cpuTime.fetch_add(static_cast<uint64_t>(sample.cpuTime.count()), std::memory_order_relaxed);
+      voluntarySwitches.fetch_add(sample.voluntarySwitches, std::memory_order_relaxed);
+      involuntarySwitches.fetch_add(sample.involuntarySwitches, std::memory_order_relaxed);
+      minorFaults.fetch_add(sample.minorFaults, std::memory_order_relaxed);
+      majorFaults.fetch_add(sample.majorFaults, std::memory_order_relaxed);
+   }
+
+   inline CommandStats Commander::Usage::stats(const std::string& name) const
+   {
+      CommandStats res;
+      res.name = name;
+      res.invocations = invocations.load(std::memory_order_relaxed);
+      res.counted = counted.load(std::memory_order_relaxed);
+      res.instructions = instructions.load(std::memory_order_relaxed);
+      res.cycles = cycles.load(std::memory_order_relaxed);
+      res.cacheMisses = cacheMisses.load(std::memory_order_relaxed);
+      res.branchMisses = branchMisses.load(std::memory_order_relaxed);
+      res.accounted = accounted.load(std::memory_order_relaxed);
+      res.wallTime = std::chrono::nanoseconds(wallTime.load(std::memory_order_relaxed));
+      res.cpuTime = std::chrono::nanoseconds(cpuTime.load(std::memory_order_relaxed));
+      res.voluntarySwitches = voluntarySwitches.load(std::memory_order_relaxed);
+      res.involuntarySwitches = involuntarySwitches.load(std::memory_order_relaxed);
+      res.minorFaults = minorFaults.load(std::memory_order_relaxed);
+      res.majorFaults = majorFaults.load(std::memory_order_relaxed);
+      return res;
+   }
+
+   inline std::shared_ptr<const Commander::Registration> Commander::lookup(const std::string& name) const
+   {
+      auto entry = slot(name);
+
+      if (!entry)
+         return nullptr;
+
+      return std::atomic_load(entry);
+   }
+
+   inline std::shared_ptr<const Commander::Registration> Commander::resolve(const std::string& name)
+   {
+      auto entry = slot(name);
+
+      if (!entry)
+         return nullptr;
+
+      auto version = std::atomic_load(entry);
+
+      if (!version)
+         version = bind(name, *entry);
+
+      if (!version->plugin)
+         return version;
+
+      version->plugin->load([this](const CommandCaller& caller)
+      {
+         auto entry = slot(caller.config().name());
+
+         // the map must not grow while commands run, so only manifest names are installed
+         if (!entry)
+            return;
+
+         CommandCaller installed = caller;
+
+         if (m_frozen)
+            installed.freeze();
+
+         auto placeholder = std::atomic_load(entry);
+         std::atomic_store(entry, std::make_shared<const Registration>(installed, nullptr,
+            placeholder ? placeholder->usage : nullptr));
+      });
+
+      version = lookup(name);
+
+      if (version->plugin)
+         throw std::runtime_error("plugin \"" + version->plugin->path() + "\" does not provide \"" + name + "\"");
+
+      return version;
+   }
+
+   inline std::shared_ptr<const Commander::Registration> Commander::bind(const std::string& name, Slot& entry)
+   {
+      CommandCaller caller;
+
+      if (m_snapshot)
+      {
+         CommandConfig config = m_snapshot->config(&entry - m_snapshotSlots.get());
+         config.freeze();
+         caller = m_binder(config);
+      }
+      else
+      {
+         caller = staticCommand(name)->caller();
+      }
+
+      if (m_frozen)
+         caller.freeze();
+
+      // threads binding the same command at once keep whichever version came first
+      Slot version = std::make_shared<const Registration>(caller);
+      Slot expected;
+
+      if (!std::atomic_compare_exchange_strong(&entry, &expected, version))
+         return expected;
+
+      return version;
+   }
+
+   inline CommandStatus Commander::unloaded(const CommandArgs& args)
+   {
+      throw std::runtime_error("command \"" + args.command() + "\" is not loaded");
+   }
+
+   inline ArgVec Commander::collect(const ArgVec& args, size_t& pos) const
+   {
+      ArgVec res = { args[pos] };
+
+      while (pos + 1 < args.size() && !isCommand(args[pos + 1]))
+         res.emplace_back(args[++pos]);
+
+      return res;
+   }
+
+   inline std::shared_ptr<Commander::Script> Commander::prepare(const ArgVec& args)
+   {
+      auto script = std::make_shared<Script>();
+
+      if (m_batchTimeout.count() > 0)
+         script->token = CancellationToken(CancellationToken::Clock::now() + m_batchTimeout);
+
+      for (size_t i = 0; i < args.size(); ++i)
+      {
+         Invocation inv;
+         std::shared_ptr<const Registration> version;
+
+         try
+         {
+            version = resolve(args[i]);
+         }
+         catch (const std::exception& ex)
+         {
+            inv.args = { args[i] };
+            inv.error = ex.what();
+            script->commands.emplace_back(std::move(inv));
+            break;
+         }
+
+         if (!version)
+         {
+            inv.args = { args[i] };
+            inv.error = "not a command";
+            script->commands.emplace_back(std::move(inv));
+            break;
+         }
+
+         inv.registration = version;
+         inv.caller = &version->caller;
+         inv.limit = version->limit.get();
+         inv.args = collect(args, i);
+
+         auto const& config = inv.caller->config();
+         script->priority = std::max(script->priority, config.priority());
+
+         try
+         {
+            bool timed = (slowThreshold(config).count() > 0);
+            auto start = (timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point());
+
+            if (!inv.caller->batched())
+               inv.parsed.reset(new CommandArgs(inv.args, config));
+
+            if (timed)
+               inv.parseTime = std::chrono::steady_clock::now() - start;
+
+            bool keyed = (m_idempotency && !config.idempotencyKey().empty());
+            std::unique_ptr<CommandArgs> transient;
+            const CommandArgs* parsed = inv.parsed.get();
+
+            if (!parsed && (keyed || !config.orderingKey().empty() || !config.resources().empty()))
+            {
+               transient.reset(new CommandArgs(inv.args, config));
+               parsed = transient.get();
+            }
+
+            if (parsed)
+               inv.locks = locks(config, *parsed);
+
+            if (keyed)
+            {
+               std::string key = parsed->getString(config.idempotencyKey(), "");
+
+               if (!key.empty())
+                  inv.idempotencyKey = config.name() + '\0' + key;
+            }
+         }
+         catch (const std::exception& ex)
+         {
+            inv.error = ex.what();
+            script->commands.emplace_back(std::move(inv));
+            break;
+         }
+
+         script->commands.emplace_back(std::move(inv));
+      }
+
+      coalesce(script->commands);
+      return script;
+   }
+
+   inline void Commander::coalesce(std::vector<Invocation>& commands)
+   {
+      auto coalesced = [](const Invocation& inv)
+      {
+         return inv.error.empty() && inv.idempotencyKey.empty() && inv.caller->config().coalescing() != Coalescing::None;
+      };
+
+      if (std::none_of(commands.begin(), commands.end(), coalesced))
+         return;
+
+      std::vector<Invocation> kept;
+
+      for (size_t first = 0, last; first < commands.size(); first = last)
+      {
+         last = first + 1;
+
+         if (coalesced(commands[first]))
+         {
+            while (last < commands.size() && coalesced(commands[last]) && commands[last].caller == commands[first].caller)
+               ++last;
+         }
+
+         if (last - first == 1)
+         {
+            kept.emplace_back(std::move(commands[first]));
+            continue;
+         }
+
+         auto const& config = commands[first].caller->config();
+
+         if (config.coalescing() == Coalescing::LastWriteWins)
+         {
+            // the last invocation for each key value survives, walking backwards finds it first
+            std::unordered_set<std::string> seen;
+            std::vector<bool> survives(last - first, true);
+
+            for (size_t i = last; i-- > first;)
+            {
+               auto const& args = commands[i].args;
+               std::string value;
+               bool found = config.coalescingKey().empty();
+
+               // without a key option the whole invocation is the key
+               for (size_t j = 1; j < args.size(); ++j)
+               {
+                  if (found && !config.coalescingKey().empty() && config.has(args[j]))
+                     break;
+
+                  if (found)
+                     value += args[j] + '\0';
+                  else
+                     found = (args[j] == config.coalescingKey());
+               }
+
+               if (found)
+                  survives[i - first] = seen.insert(value).second;
+            }
+
+            for (size_t i = first; i < last; ++i)
+            {
+               if (survives[i - first])
+                  kept.emplace_back(std::move(commands[i]));
+            }
+         }
+         else
+         {
+            // the last invocation carries the merged arguments, reparsed once
+            ArgVec args = merge(config, commands, first, last);
+            std::unique_ptr<CommandArgs> parsed;
+
+            try
+            {
+               parsed.reset(new CommandArgs(args, config));
+            }
+            catch (const std::exception&)
+            {
+               // batched invocations are not validated before; left unmerged, the bad one fails when it runs
+               for (size_t i = first; i < last; ++i)
+                  kept.emplace_back(std::move(commands[i]));
+
+               continue;
+            }
+
+            Invocation inv = std::move(commands[last - 1]);
+            inv.args = std::move(args);
+            inv.locks = locks(config, *parsed);
+
+            if (inv.parsed)
+               inv.parsed = std::move(parsed);
+
+            kept.emplace_back(std::move(inv));
+         }
+      }
+
+      commands = std::move(kept);
+   }
+
+   inline ArgVec Commander::merge(const CommandConfig& config, const std::vector<Invocation>& commands, size_t first, size_t last)
+   {
+      // an option with its values, values before any option are under the empty name
+      std::vector<std::pair<std::string, ArgVec>> segments = { { std::string(), ArgVec() } };
+
+      for (size_t i = first; i < last; ++i)
+      {
+         auto const& args = commands[i].args;
+         std::vector<std::pair<std::string, ArgVec>> own = { { std::string(), ArgVec() } };
+
+         for (size_t j = 1; j < args.size(); ++j)
+         {
+            if (config.has(args[j]))
+               own.push_back({ args[j], ArgVec() });
+            else
+               own.back().second.push_back(args[j]);
+         }
+
+         for (auto& segment : own)
+         {
+            if (segment.first.empty() && segment.second.empty())
+               continue;
+
+            auto it = std::find_if(segments.begin(), segments.end(),
+               [&segment](const std::pair<std::string, ArgVec>& other) { return other.first == segment.first; });
+
+            if (it != segments.end())
+               it->second = std::move(segment.second);
+            else
+               segments.push_back(std::move(segment));
+         }
+      }
+
+      ArgVec res = { commands[first].args.front() };
+
+      for (auto& segment : segments)
+      {
+         if (!segment.first.empty())
+            res.push_back(segment.first);
+
+         res.insert(res.end(), segment.second.begin(), segment.second.end());
+      }
+
+      return res;
+   }
+
+   inline void Commander::sequence(Script& script)
+   {
+      script.sequenced = true;
+
+      // scripts without ordering keys or resources never touch the lock manager
+      if (std::all_of(script.commands.begin(), script.commands.end(), [](const Invocation& inv) { return inv.locks.empty(); }))
+         return;
+
+      auto lock = m_locks.lock();
+
+      for (auto& inv : script.commands)
+      {
+         for (auto& req : inv.locks)
+            m_locks.issue(req, lock);
+      }
+   }
+
+   inline void Commander::execute(const std::shared_ptr<Script>& script)
+   {
+      auto& commands = script->commands;
+      bool failed = false;
+
+      while (script->next < commands.size() && !failed)
+      {
+         auto& inv = commands[script->next];
+         bool ordered = (script->sequenced && !inv.locks.empty());
+         bool limited = (script->sequenced && inv.limit);
+
+         if (!inv.error.empty())
+         {
+            report(*script, CommandStatus(inv.args.front(), CommandStatus::ERROR, inv.error));
+            break;
+         }
+
+         CommandStatus cached;
+         bool cancelled = script->token.cancelled();
+
+         if (cancelled || script->attached || duplicate(inv, cached))
+         {
+            // the rest of a cancelled script is reported but never run, as are retried commands
+            report(*script, cancelled ? CommandStatus(inv.caller->config().name(), CommandStatus::TIMEOUT, "batch deadline exceeded")
+               : script->attached ? script->result : cached);
+            ++script->next;
+            script->attached = false;
+
+            if (ordered)
+               resume(m_locks.release(inv.locks));
+
+            if (script->admitted)
+               resume({ inv.limit->release() });
+
+            script->admitted = false;
+            continue;
+         }
+
+         if (ordered && !m_locks.enter(inv.locks, [this, script] { schedule(script); }))
+            return;
+
+         if (limited && !script->admitted && !inv.limit->acquire([this, script] { script->admitted = true; schedule(script); }))
+            return;
+
+         // a retry parks holding its tickets and permit, the run it waits for already holds its own
+         script->admitted = limited;
+         bool owner = false;
+
+         if (!claim(script, inv, owner))
+            return;
+
+         script->admitted = false;
+         std::vector<uint64_t> journaled;
+
+         try
+         {
+            CancellationToken tok = token(script->token, inv.caller->config());
+            CommandStatus stat;
+            journal(inv.args, journaled);
+
+            if (inv.caller->batched() && !ordered && inv.idempotencyKey.empty())
+            {
+               // coalesce the run of consecutive invocations into one call
+               CommandBatch batch(inv.caller->config());
+               batch.append(inv.args);
+               batch.token(tok);
+
+               while (script->next + 1 < commands.size() && commands[script->next + 1].caller == inv.caller
+                  && commands[script->next + 1].locks.empty() && commands[script->next + 1].error.empty()
+                  && commands[script->next + 1].idempotencyKey.empty())
+               {
+                  batch.append(commands[++script->next].args);
+                  journal(commands[script->next].args, journaled);
+               }
+
+               awaitJournal(journaled);
+               stat = measure(*inv.registration, batch.size(), inv.args, inv.parseTime,
+                  [&inv, &batch] { return inv.caller->invoke(batch); });
+            }
+            else if (inv.parsed)
+            {
+               inv.parsed->token(tok);
+               awaitJournal(journaled);
+               stat = measure(*inv.registration, 1, inv.args, inv.parseTime,
+                  [&inv] { return inv.caller->invoke(*inv.parsed); });
+            }
+            else
+            {
+               awaitJournal(journaled);
+               stat = measure(*inv.registration, 1, inv.args, inv.parseTime,
+                  [&inv, &tok] { return inv.caller->invoke(inv.args, tok); });
+            }
+
+            stat = expire(stat, tok);
+            journal(journaled, stat);
+            remember(inv, stat);
+
+            if (owner)
+               settle(inv, stat);
+
+            report(*script, stat);
+         }
+         catch (const std::exception& ex)
+         {
+            CommandStatus stat(inv.caller->config().name(), CommandStatus::ERROR, ex.what());
+            journal(journaled, stat);
+
+            if (owner)
+               settle(inv, stat);
+
+            report(*script, stat);
+            failed = true;
+         }
+         catch (...)
+         {
+            // anything else escaping here would strand the tickets and permits held below
+            CommandStatus stat(inv.caller->config().name(), CommandStatus::ERROR, "unknown exception");
+            journal(journaled, stat);
+
+            if (owner)
+               settle(inv, stat);
+
+            report(*script, stat);
+            failed = true;
+         }
+
+         ++script->next;
+
+         if (limited)
+            resume({ inv.limit->release() });
+
+         if (ordered)
+            resume(m_locks.release(inv.locks));
+      }
+
+      retire(*script);
+
+      if (script->done)
+         script->done(script->statuses);
+   }
+
+   inline void Commander::retire(Script& script)
+   {
+      if (script.sequenced)
+      {
+         // the remaining tickets would otherwise block their resources forever
+         for (size_t i = script.next; i < script.commands.size(); ++i)
+            resume(m_locks.release(script.commands[i].locks));
+      }
+
+      script.next = script.commands.size();
+   }
+
+   inline void Commander::schedule(const std::shared_ptr<Script>& script)
+   {
+      if (!m_executor || !m_executor->post([this, script] { execute(script); }, script->priority))
+         execute(script);
+   }
+
+   inline void Commander::resume(std::vector<Executor::Task> continuations)
+   {
+      for (auto& continuation : continuations)
+      {
+         if (continuation)
+            continuation();
+      }
+   }
+
+   inline CancellationToken Commander::token(const CancellationToken& script, const CommandConfig& config)
+   {
+      if (config.timeout().count() == 0)
+         return script;
+
+      return CancellationToken(CancellationToken::Clock::now() + config.timeout(), script);
+   }
+
+   inline CommandStatus Commander::expire(CommandStatus stat, const CancellationToken& token)
+   {
+      if (!token.cancelled())
+         return stat;
+
+      return CommandStatus(stat.name, CommandStatus::TIMEOUT, "deadline exceeded");
+   }
+
+   inline std::vector<LockManager::Request> Commander::locks(const CommandConfig& config, const CommandArgs& args)
+   {
+      std::vector<LockManager::Request> res;
+
+      auto add = [&res](const std::string& resource, Access access)
+      {
+         for (auto& req : res)
+         {
+            // one ticket per resource, a command must not wait for itself
+            if (req.resource == resource)
+            {
+               if (access == Access::Write)
+                  req.access = Access::Write;
+
+               return;
+            }
+         }
+
+         res.push_back({ resource, access, 0 });
+      };
+
+      std::string key = (config.orderingKey().empty() ? "" : args.getString(config.orderingKey(), ""));
+
+      if (!key.empty())
+         add(key, Access::Write);
+
+      for (auto const& resource : config.resources())
+      {
+         if (!resource.derived)
+         {
+            add(resource.name, resource.access);
+            continue;
+         }
+
+         for (auto const& value : args.getStrVec(resource.name))
+            add(value, resource.access);
+      }
+
+      return res;
+   }
+
+   inline void Commander::journal(const ArgVec& args, std::vector<uint64_t>& sequences)
+   {
+      if (m_wal)
+         sequences.push_back(m_wal->command(args));
+   }
+
+   inline void Commander::journal(const std::vector<uint64_t>& sequences, const CommandStatus& stat)
+   {
+      // a coalesced batch journals its one status for each of its commands
+      for (uint64_t sequence : sequences)
+         m_wal->result(sequence, stat.status, stat.name, stat.msg);
+   }
+
+   inline void Commander::awaitJournal(const std::vector<uint64_t>& sequences)
+   {
+      // the last command is durable once every earlier one is
+      if (!sequences.empty() && m_wal->waitBeforeRun())
+         m_wal->waitDurable(sequences.back());
+   }
+
+   inline bool Commander::duplicate(const Invocation& inv, CommandStatus& stat)
+   {
+      return (m_idempotency && !inv.idempotencyKey.empty() && m_idempotency->find(inv.idempotencyKey, stat));
+   }
+
+   inline void Commander::remember(const Invocation& inv, const CommandStatus& stat)
+   {
+      if (m_idempotency && !inv.idempotencyKey.empty() && stat.status != CommandStatus::TIMEOUT)
+         m_idempotency->insert(inv.idempotencyKey, stat);
+   }
+
+   inline bool Commander::claim(const std::shared_ptr<Script>& script, const Invocation& inv, bool& owner)
+   {
+      if (!m_idempotency || inv.idempotencyKey.empty())
+         return true;
+
+      std::unique_lock<std::mutex> lock(m_inflightMutex);
+      auto it = m_inflight.find(inv.idempotencyKey);
+
+      if (it == m_inflight.end())
+      {
+         // the first run may have returned since the script looked the key up
+         if (m_idempotency->find(inv.idempotencyKey, script->result))
+         {
+            script->attached = true;
+            lock.unlock();
+            schedule(script);
+            return false;
+         }
+
+         m_inflight.emplace(inv.idempotencyKey, std::vector<std::shared_ptr<Script>>());
+         owner = true;
+         return true;
+      }
+
+      // run() does not wait for another thread and runs the retry again
+      if (!script->sequenced)
+         return true;
+
+      it->second.push_back(script);
+      return false;
+   }
+
+   inline void Commander::settle(const Invocation& inv, const CommandStatus& stat)
+   {
+      std::vector<std::shared_ptr<Script>> parked;
+
+      {
+         std::lock_guard<std::mutex> lock(m_inflightMutex);
+         auto it = m_inflight.find(inv.idempotencyKey);
+         parked.swap(it->second);
+         m_inflight.erase(it);
+      }
+
+      for (auto& script : parked)
+      {
+         script->result = stat;
+         script->attached = true;
+         schedule(script);
+      }
+   }
+
+   inline void Commander::report(Script& script, const CommandStatus& stat)
+   {
+      if (script.done)
+         script.statuses.push_back(stat);
+
+      try
+      {
+         report(stat);
+      }
+      catch (...)
+      {
+         // a throwing handler must not abort the script while it holds locks
+      }
+   }
+
+   inline void Commander::report(const CommandStatus& stat)
+   {
+      if (!m_handler)
+         return;
+
+      if (m_handler->concurrent())
+      {
+         m_handler->handle(stat);
+         return;
+      }
+
+      std::lock_guard<std::mutex> lock(m_handlerMutex);
+      m_handler->handle(stat);
    }
 }
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace comp
+{
+   // Pieces shared by the wire formats: the status log, the write-ahead
+   // log and the remote protocol all use LEB128 varints and spell status
+   // values the same way.
+   struct Encoding
+   {
+      // bytes the largest varint takes
+      static constexpr size_t MaxVarint = 10;
+
+      // writes value to out, which has room for MaxVarint bytes, and returns the bytes used
+      static size_t varint(uint64_t value, char* out);
+      static void varint(std::string& out, uint64_t value);
+      // false when the input ends inside the varint or it runs past 64 bits
+      static bool varint(const char*& in, const char* end, uint64_t& value);
+
+      // name of a CommandStatus::Status value
+      static const char* statusName(int status);
+   };
+
+   inline size_t Encoding::varint(uint64_t value, char* out)
+   {
+      size_t size = 0;
+
+      for (; value >= 0x80; value >>= 7)
+         out[size++] = static_cast<char>((value & 0x7F) | 0x80);
+
+      out[size++] = static_cast<char>(value);
+      return size;
+   }
+
+   inline void Encoding::varint(std::string& out, uint64_t value)
+   {
+      char buffer[MaxVarint];
+      out.append(buffer, varint(value, buffer));
+   }
+
+   inline bool Encoding::varint(const char*& in, const char* end, uint64_t& value)
+   {
+      value = 0;
+
+      for (unsigned shift = 0; in != end && shift < 64; shift += 7)
+      {
+         auto byte = static_cast<unsigned char>(*in++);
+         value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+         if ((byte & 0x80) == 0)
+            return true;
+      }
+
+      return false;
+   }
+
+   inline const char* Encoding::statusName(int status)
+   {
+      // in the order of CommandStatus::Status
+      static const char* const names[] = { "ERROR", "OK", "TIMEOUT" };
+      return (status >= 0 && status < 3 ? names[status] : "UNKNOWN");
+   }
+}
\ No newline at end of file
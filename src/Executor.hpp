@@ -0,0 +1,687 @@
+#pragma once
+
+#include "MpmcQueue.hpp"
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace comp
+{
+   enum class Placement
+   {
+      // workers float, the OS schedules them freely
+      Unpinned,
+      // each worker is pinned to one allowed CPU
+      Pinned,
+      // workers are pinned and spread evenly over NUMA nodes,
+      // stealing prefers victims on the same node
+      NumaSpread
+   };
+
+   enum class Priority
+   {
+      // scripts and batch jobs, served when no interactive work waits
+      Bulk,
+      // operator commands, served first
+      Interactive
+   };
+
+   // Work-stealing pool with one lane per priority. External producers feed
+   // a shared bounded queue per lane, tasks posted from a worker go to that
+   // worker's own deque and are stolen by idle workers only. Workers serve
+   // the interactive lane first but take a waiting bulk task after a run of
+   // starvationLimit interactive ones. Idle workers sleep on a futex.
+   class Executor
+   {
+   public:
+
+      using Task = std::function<void()>;
+
+      Executor(size_t capacity = 4096);
+      ~Executor();
+
+      Executor(const Executor&) = delete;
+      Executor& operator=(const Executor&) = delete;
+
+      void start(size_t workers, Placement placement = Placement::Unpinned);
+      // finishes the queued tasks and joins the workers
+      void stop();
+
+      bool post(Task task, Priority priority = Priority::Bulk);
+      // all-or-nothing enqueue of several tasks
+      bool post(std::vector<Task>& tasks, Priority priority = Priority::Bulk);
+
+      void starvationLimit(size_t limit);
+      size_t starvationLimit() const;
+
+      bool running() const;
+      size_t workers() const;
+
+   private:
+
+      static constexpr size_t LaneCount = 2;
+
+      struct alignas(64) Worker
+      {
+         std::mutex mutex;
+         std::deque<Task> tasks[LaneCount];
+         // interactive tasks taken in a row
+         size_t streak{ 0 };
+         std::thread thread;
+         int cpu{ -1 };
+         int node{ 0 };
+         // steal order, workers of the same node first
+         std::vector<size_t> victims;
+      };
+
+      struct Current
+      {
+         Executor* owner{ nullptr };
+         Worker* worker{ nullptr };
+      };
+
+      static Current& current();
+      static std::vector<int> allowedCpus();
+      static std::vector<std::vector<int>> numaNodes(const std::vector<int>& allowed);
+      static void pin(int cpu);
+
+      void place(Placement placement);
+      void work(Worker& self);
+      bool next(Worker& self, Task& task);
+      bool take(Worker& self, size_t lane, Task& task);
+
+      static constexpr size_t SpinCount = 64;
+
+      std::unique_ptr<MpmcQueue<Task>> m_queues[LaneCount];
+      std::atomic<size_t> m_starvationLimit{ 16 };
+      Futex m_signal;
+      std::atomic<bool> m_stopping{ false };
+      std::vector<std::unique_ptr<Worker>> m_workers;
+   };
+
+   enum class Access
+   {
+      Read,
+      Write
+   };
+
+   // Read/write lock manager for scheduled work. Every piece of work takes
+   // tickets on the resources it touches in submission order; a ticket is
+   // granted once all earlier conflicting tickets on that resource were
+   // released. Work that can not run yet parks a continuation instead of
+   // blocking and gets it back from the release that unblocks it.
+   class LockManager
+   {
+   public:
+
+      using Task = Executor::Task;
+
+      struct Request
+      {
+         std::string resource;
+         Access access{ Access::Write };
+         uint64_t ticket{ 0 };
+      };
+
+      // issue() is only valid while the lock is held, so that a script
+      // touching several resources takes all of its tickets atomically
+      std::unique_lock<std::mutex> lock();
+      void issue(Request& request, const std::unique_lock<std::mutex>& lock);
+
+      // returns false and keeps the continuation when some request is not granted yet
+      bool enter(const std::vector<Request>& requests, Task continuation);
+      // drops the tickets, whether they entered or not, and returns the continuations they unblocked
+      std::vector<Task> release(const std::vector<Request>& requests);
+
+   private:
+
+      struct Entry
+      {
+         Access access;
+         Task parked;
+      };
+
+      using Queue = std::map<uint64_t, Entry>;
+
+      struct Resource
+      {
+         uint64_t issued{ 0 };
+         Queue queue;
+      };
+
+      static bool granted(const Queue& queue, Queue::const_iterator entry);
+
+      std::mutex m_mutex;
+      std::unordered_map<std::string, Resource> m_resources;
+   };
+
+   // Counting semaphore for scheduled work. An acquirer finding no permit
+   // parks a continuation instead of blocking its thread; release() hands
+   // the permit straight to the oldest parked continuation. Uncontended
+   // acquire and release are a single atomic operation.
+   class Semaphore
+   {
+   public:
+
+      using Task = Executor::Task;
+
+      Semaphore(size_t permits);
+
+      Semaphore(const Semaphore&) = delete;
+      Semaphore& operator=(const Semaphore&) = delete;
+
+      // returns false and keeps the continuation, which later runs holding the permit
+      bool acquire(Task continuation);
+      // returns the continuation the permit was handed to, if any
+      Task release();
+
+   private:
+
+      // free permits minus parked acquirers
+      std::atomic<int64_t> m_count;
+      std::mutex m_mutex;
+      std::deque<Task> m_waiters;
+      // permits released before their acquirer managed to park
+      size_t m_handoffs{ 0 };
+   };
+
+   inline Executor::Executor(size_t capacity)
+   {
+      for (auto& queue : m_queues)
+         queue.reset(new MpmcQueue<Task>(capacity));
+   }
+
+   inline Executor::~Executor()
+   {
+      stop();
+   }
+
+   inline void Executor::start(size_t workers, Placement placement)
+   {
+      if (running())
+         throw std::runtime_error("executor is already running");
+
+      m_stopping.store(false);
+
+      try
+      {
+         for (size_t i = 0; i < (workers ? workers : 1); ++i)
+            m_workers.emplace_back(new Worker);
+
+         place(placement);
+
+         for (auto& worker : m_workers)
+         {
+            Worker& self = *worker;
+
+            self.thread = std::thread([this, &self]
+            {
+               if (self.cpu >= 0)
+                  pin(self.cpu);
+
+               work(self);
+            });
+         }
+      }
+      catch (...)
+      {
+         // leave the executor stopped, joining only the threads that did start
+         m_stopping.store(true);
+         m_signal.notifyAll();
+
+         for (auto& worker : m_workers)
+         {
+            if (worker->thread.joinable())
+               worker->thread.join();
+         }
+
+         m_workers.clear();
+         throw;
+      }
+   }
+
+   inline void Executor::stop()
+   {
+      if (!running())
+         return;
+
+      m_stopping.store(true);
+      m_signal.notifyAll();
+
+      for (auto& worker : m_workers)
+         worker->thread.join();
+
+      m_workers.clear();
+   }
+
+   inline bool Executor::post(Task task, Priority priority)
+   {
+      Current& cur = current();
+      size_t lane = static_cast<size_t>(priority);
+
+      // work spawned by a running task stays on its core unless stolen
+      if (cur.owner == this)
+      {
+         std::lock_guard<std::mutex> guard(cur.worker->mutex);
+         cur.worker->tasks[lane].emplace_back(std::move(task));
+      }
+      else if (!m_queues[lane]->tryPush(std::move(task)))
+      {
+         return false;
+      }
+
+      m_signal.notifyOne();
+      return true;
+   }
+
+   inline bool Executor::post(std::vector<Task>& tasks, Priority priority)
+   {
+      Current& cur = current();
+      size_t lane = static_cast<size_t>(priority);
+
+      if (cur.owner == this)
+      {
+         std::lock_guard<std::mutex> guard(cur.worker->mutex);
+
+         for (auto& task : tasks)
+            cur.worker->tasks[lane].emplace_back(std::move(task));
+      }
+      else if (!m_queues[lane]->tryPushBulk(tasks.begin(), tasks.size()))
+      {
+         return false;
+      }
+
+      if (tasks.size() == 1)
+         m_signal.notifyOne();
+      else if (!tasks.empty())
+         m_signal.notifyAll();
+
+      return true;
+   }
+
+   inline void Executor::starvationLimit(size_t limit)
+   {
+      m_starvationLimit.store(limit ? limit : 1);
+   }
+
+   inline size_t Executor::starvationLimit() const
+   {
+      return m_starvationLimit.load();
+   }
+
+   inline bool Executor::running() const
+   {
+      return !m_workers.empty();
+   }
+
+   inline size_t Executor::workers() const
+   {
+      return m_workers.size();
+   }
+
+   inline Executor::Current& Executor::current()
+   {
+      thread_local Current cur;
+      return cur;
+   }
+
+   inline std::vector<int> Executor::allowedCpus()
+   {
+      std::vector<int> res;
+
+#ifdef __linux__
+      cpu_set_t set;
+      CPU_ZERO(&set);
+
+      if (sched_getaffinity(0, sizeof(set), &set) == 0)
+      {
+         for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+         {
+            if (CPU_ISSET(cpu, &set))
+               res.push_back(cpu);
+         }
+      }
+#endif
+
+      return res;
+   }
+
+   inline std::vector<std::vector<int>> Executor::numaNodes(const std::vector<int>& allowed)
+   {
+      std::vector<std::vector<int>> res;
+
+#ifdef __linux__
+      for (int node = 0;; ++node)
+      {
+         std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+
+         if (!file)
+            break;
+
+         // ranges like "0-3,8-11", a node without CPUs lists just "\n"
+         std::vector<int> cpus;
+         std::string range;
+
+         while (std::getline(file, range, ','))
+         {
+            const char* text = range.c_str();
+            char* end = nullptr;
+            long first = std::strtol(text, &end, 10);
+
+            if (end == text)
+               continue;
+
+            long last = first;
+
+            if (*end == '-')
+            {
+               text = end + 1;
+               last = std::strtol(text, &end, 10);
+
+               if (end == text)
+                  continue;
+            }
+
+            for (int cpu = static_cast<int>(first); cpu <= last; ++cpu)
+            {
+               if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+                  cpus.push_back(cpu);
+            }
+         }
+
+         if (!cpus.empty())
+            res.emplace_back(std::move(cpus));
+      }
+#endif
+
+      if (res.empty())
+         res.push_back(allowed);
+
+      return res;
+   }
+
+   inline void Executor::pin(int cpu)
+   {
+#ifdef __linux__
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+      (void)cpu;
+#endif
+   }
+
+   inline void Executor::place(Placement placement)
+   {
+      std::vector<int> allowed = (placement == Placement::Unpinned ? std::vector<int>() : allowedCpus());
+
+      if (!allowed.empty())
+      {
+         auto nodes = (placement == Placement::NumaSpread ? numaNodes(allowed) : std::vector<std::vector<int>>{ allowed });
+         std::vector<size_t> used(nodes.size(), 0);
+
+         for (size_t i = 0; i < m_workers.size(); ++i)
+         {
+            size_t node = i % nodes.size();
+            auto const& cpus = nodes[node];
+
+            m_workers[i]->node = static_cast<int>(node);
+            m_workers[i]->cpu = cpus[used[node]++ % cpus.size()];
+         }
+      }
+
+      for (size_t i = 0; i < m_workers.size(); ++i)
+      {
+         auto& victims = m_workers[i]->victims;
+
+         for (size_t k = 1; k < m_workers.size(); ++k)
+            victims.push_back((i + k) % m_workers.size());
+
+         std::stable_partition(victims.begin(), victims.end(),
+            [this, i](size_t v) { return m_workers[v]->node == m_workers[i]->node; });
+      }
+   }
+
+   inline void Executor::work(Worker& self)
+   {
+      current() = Current{ this, &self };
+
+      Task task;
+      size_t idle = 0;
+
+      for (;;)
+      {
+         uint32_t observed = m_signal.value();
+
+         if (next(self, task))
+         {
+            idle = 0;
+
+            try
+            {
+               task();
+            }
+            catch (...)
+            {}
+
+            task = nullptr;
+            continue;
+         }
+
+         if (m_stopping.load())
+            break;
+
+         if (++idle < SpinCount)
+            std::this_thread::yield();
+         else
+            m_signal.wait(observed);
+      }
+
+      current() = Current{};
+   }
+
+   inline bool Executor::next(Worker& self, Task& task)
+   {
+      const size_t bulk = static_cast<size_t>(Priority::Bulk);
+      const size_t interactive = static_cast<size_t>(Priority::Interactive);
+
+      // a long run of interactive work lets one waiting bulk task through
+      if (self.streak >= m_starvationLimit.load(std::memory_order_relaxed) && take(self, bulk, task))
+      {
+         self.streak = 0;
+         return true;
+      }
+
+      if (take(self, interactive, task))
+      {
+         ++self.streak;
+         return true;
+      }
+
+      if (take(self, bulk, task))
+      {
+         self.streak = 0;
+         return true;
+      }
+
+      return false;
+   }
+
+   inline bool Executor::take(Worker& self, size_t lane, Task& task)
+   {
+      {
+         // newest first: its data is most likely still in this core's cache
+         std::lock_guard<std::mutex> guard(self.mutex);
+         auto& tasks = self.tasks[lane];
+
+         if (!tasks.empty())
+         {
+            task = std::move(tasks.back());
+            tasks.pop_back();
+            return true;
+         }
+      }
+
+      if (m_queues[lane]->tryPop(task))
+         return true;
+
+      for (size_t v : self.victims)
+      {
+         Worker& victim = *m_workers[v];
+         std::lock_guard<std::mutex> guard(victim.mutex);
+         auto& tasks = victim.tasks[lane];
+
+         if (!tasks.empty())
+         {
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   inline Semaphore::Semaphore(size_t permits) :
+      m_count(static_cast<int64_t>(permits))
+   {}
+
+   inline bool Semaphore::acquire(Task continuation)
+   {
+      if (m_count.fetch_sub(1, std::memory_order_acquire) > 0)
+         return true;
+
+      std::lock_guard<std::mutex> guard(m_mutex);
+
+      if (m_handoffs > 0)
+      {
+         --m_handoffs;
+         return true;
+      }
+
+      m_waiters.emplace_back(std::move(continuation));
+      return false;
+   }
+
+   inline Semaphore::Task Semaphore::release()
+   {
+      if (m_count.fetch_add(1, std::memory_order_release) >= 0)
+         return nullptr;
+
+      std::lock_guard<std::mutex> guard(m_mutex);
+
+      if (m_waiters.empty())
+      {
+         ++m_handoffs;
+         return nullptr;
+      }
+
+      Task task = std::move(m_waiters.front());
+      m_waiters.pop_front();
+      return task;
+   }
+
+   inline std::unique_lock<std::mutex> LockManager::lock()
+   {
+      return std::unique_lock<std::mutex>(m_mutex);
+   }
+
+   inline void LockManager::issue(Request& request, const std::unique_lock<std::mutex>& lock)
+   {
+      if (lock.mutex() != &m_mutex || !lock.owns_lock())
+         throw std::logic_error("lock manager is not locked");
+
+      Resource& res = m_resources[request.resource];
+      request.ticket = res.issued++;
+      res.queue.emplace(request.ticket, Entry{ request.access, nullptr });
+   }
+
+   inline bool LockManager::enter(const std::vector<Request>& requests, Task continuation)
+   {
+      std::lock_guard<std::mutex> guard(m_mutex);
+
+      for (auto const& req : requests)
+      {
+         Queue& queue = m_resources.at(req.resource).queue;
+         auto entry = queue.find(req.ticket);
+
+         // park on the first blocker, the release lifting it re-checks the rest
+         if (!granted(queue, entry))
+         {
+            entry->second.parked = std::move(continuation);
+            return false;
+         }
+      }
+
+      return true;
+   }
+
+   inline std::vector<LockManager::Task> LockManager::release(const std::vector<Request>& requests)
+   {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      std::vector<Task> res;
+
+      for (auto const& req : requests)
+      {
+         auto it = m_resources.find(req.resource);
+         Queue& queue = it->second.queue;
+
+         queue.erase(req.ticket);
+
+         // the granted prefix is either one writer or a run of readers
+         for (auto entry = queue.begin(); entry != queue.end(); ++entry)
+         {
+            if (entry != queue.begin() && entry->second.access == Access::Write)
+               break;
+
+            if (entry->second.parked)
+               res.emplace_back(std::move(entry->second.parked));
+
+            entry->second.parked = nullptr;
+
+            if (entry->second.access == Access::Write)
+               break;
+         }
+
+         if (queue.empty())
+            m_resources.erase(it);
+      }
+
+      return res;
+   }
+
+   inline bool LockManager::granted(const Queue& queue, Queue::const_iterator entry)
+   {
+      if (entry == queue.begin())
+         return true;
+
+      if (entry->second.access == Access::Write)
+         return false;
+
+      for (auto it = queue.begin(); it != entry; ++it)
+      {
+         if (it->second.access == Access::Write)
+            return false;
+      }
+
+      return true;
+   }
+}
\ No newline at end of file
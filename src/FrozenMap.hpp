@@ -0,0 +1,245 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace comp
+{
+   // Hash functions of FrozenMap, shared with tables that store its layout
+   // elsewhere, such as registry snapshots
+   struct PerfectHash
+   {
+      static uint64_t hash(const char* data, size_t size);
+      static uint64_t mix(uint64_t hash, uint64_t seed);
+      // slot of a key hash given the per-bucket seeds, both counts are powers of two
+      static size_t slot(uint64_t hash, const uint32_t* seeds, size_t bucketCount, size_t slotCount);
+      static size_t bucket(uint64_t hash, size_t bucketCount);
+   };
+
+   // Immutable string-keyed table with a perfect hash built by hash and
+   // displace: keys are grouped into small buckets, and each bucket gets a
+   // seed under which all of its keys land in distinct free slots. A lookup
+   // hashes the key once and compares it against exactly one candidate.
+   template<typename T>
+   class FrozenMap
+   {
+   public:
+
+      struct Entry
+      {
+         std::string key;
+         T value{};
+         bool used{ false };
+      };
+
+      FrozenMap() = default;
+
+      // builds from a range of (std::string, T) pairs, keys must be unique
+      template<typename Iterator>
+      FrozenMap(Iterator first, Iterator last);
+
+      const T* find(const std::string& key) const;
+      T* find(const std::string& key);
+
+      size_t size() const;
+      bool empty() const;
+
+      // slots in table order, unused ones included
+      const std::vector<Entry>& entries() const;
+      // seed of every bucket, see PerfectHash::slot
+      const std::vector<uint32_t>& seeds() const;
+
+   private:
+
+      static constexpr uint32_t MaxSeed = 1u << 24;
+
+      std::vector<Entry> m_entries;
+      std::vector<uint32_t> m_seeds;
+      size_t m_size{ 0 };
+   };
+
+   template<typename T>
+   template<typename Iterator>
+   inline FrozenMap<T>::FrozenMap(Iterator first, Iterator last)
+   {
+      std::vector<std::pair<std::string, T>> items;
+
+      for (; first != last; ++first)
+         items.emplace_back(first->first, first->second);
+
+      m_size = items.size();
+
+      size_t slots = 1;
+      size_t buckets = 1;
+
+      while (slots < m_size + m_size / 4 + 1)
+         slots <<= 1;
+
+      while (buckets < m_size / 4)
+         buckets <<= 1;
+
+      m_entries.resize(slots);
+      m_seeds.assign(buckets, 0);
+
+      std::vector<std::vector<size_t>> groups(buckets);
+      std::vector<uint64_t> hashes(items.size());
+
+      for (size_t i = 0; i < items.size(); ++i)
+      {
+         hashes[i] = PerfectHash::hash(items[i].first.data(), items[i].first.size());
+         groups[PerfectHash::bucket(hashes[i], buckets)].push_back(i);
+      }
+
+      std::vector<size_t> order(buckets);
+
+      for (size_t b = 0; b < buckets; ++b)
+         order[b] = b;
+
+      // place the largest buckets first while the table is still empty
+      std::sort(order.begin(), order.end(), [&groups](size_t a, size_t b) { return groups[a].size() > groups[b].size(); });
+
+      std::vector<size_t> taken;
+
+      for (size_t b : order)
+      {
+         auto const& group = groups[b];
+
+         if (group.empty())
+            break;
+
+         // identical keys collide under every seed
+         for (size_t i = 0; i < group.size(); ++i)
+         {
+            for (size_t k = i + 1; k < group.size(); ++k)
+            {
+               if (items[group[i]].first == items[group[k]].first)
+                  throw std::runtime_error("duplicate key \"" + items[group[i]].first + "\"");
+            }
+         }
+
+         uint32_t seed = 1;
+
+         for (; seed < MaxSeed; ++seed)
+         {
+            taken.clear();
+
+            for (size_t i : group)
+            {
+               size_t pos = PerfectHash::mix(hashes[i], seed) & (slots - 1);
+
+               if (m_entries[pos].used || std::find(taken.begin(), taken.end(), pos) != taken.end())
+                  break;
+
+               taken.push_back(pos);
+            }
+
+            if (taken.size() == group.size())
+               break;
+         }
+
+         if (seed == MaxSeed)
+            throw std::runtime_error("perfect hash construction failed");
+
+         m_seeds[b] = seed;
+
+         for (size_t k = 0; k < group.size(); ++k)
+         {
+            Entry& entry = m_entries[taken[k]];
+            entry.key = std::move(items[group[k]].first);
+            entry.value = std::move(items[group[k]].second);
+            entry.used = true;
+         }
+      }
+   }
+
+   template<typename T>
+   inline const T* FrozenMap<T>::find(const std::string& key) const
+   {
+      if (m_size == 0)
+         return nullptr;
+
+      uint64_t h = PerfectHash::hash(key.data(), key.size());
+      const Entry& entry = m_entries[PerfectHash::slot(h, m_seeds.data(), m_seeds.size(), m_entries.size())];
+      return (entry.used && entry.key == key ? &entry.value : nullptr);
+   }
+
+   template<typename T>
+   inline T* FrozenMap<T>::find(const std::string& key)
+   {
+      return const_cast<T*>(static_cast<const FrozenMap&>(*this).find(key));
+   }
+
+   template<typename T>
+   inline size_t FrozenMap<T>::size() const
+   {
+      return m_size;
+   }
+
+   template<typename T>
+   inline bool FrozenMap<T>::empty() const
+   {
+      return (m_size == 0);
+   }
+
+   template<typename T>
+   inline const std::vector<typename FrozenMap<T>::Entry>& FrozenMap<T>::entries() const
+   {
+      return m_entries;
+   }
+
+   template<typename T>
+   inline const std::vector<uint32_t>& FrozenMap<T>::seeds() const
+   {
+      return m_seeds;
+   }
+
+   inline uint64_t PerfectHash::hash(const char* data, size_t size)
+   {
+      // eight bytes per multiply, names rarely need more than two rounds
+      uint64_t res = size * 0x9E3779B97F4A7C15ull;
+      uint64_t word;
+
+      for (; size >= 8; data += 8, size -= 8)
+      {
+         std::memcpy(&word, data, 8);
+         res = (res ^ word) * 0xBF58476D1CE4E5B9ull;
+         res ^= res >> 29;
+      }
+
+      if (size > 0)
+      {
+         word = 0;
+
+         for (size_t i = 0; i < size; ++i)
+            word |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (i * 8);
+
+         res = (res ^ word) * 0x94D049BB133111EBull;
+      }
+
+      return res ^ (res >> 32);
+   }
+
+   inline uint64_t PerfectHash::mix(uint64_t hash, uint64_t seed)
+   {
+      // splitmix64 finalizer
+      uint64_t res = hash + seed * 0x9E3779B97F4A7C15ull;
+      res = (res ^ (res >> 30)) * 0xBF58476D1CE4E5B9ull;
+      res = (res ^ (res >> 27)) * 0x94D049BB133111EBull;
+      return res ^ (res >> 31);
+   }
+
+   inline size_t PerfectHash::bucket(uint64_t hash, size_t bucketCount)
+   {
+      return static_cast<size_t>((hash >> 40) & (bucketCount - 1));
+   }
+
+   inline size_t PerfectHash::slot(uint64_t hash, const uint32_t* seeds, size_t bucketCount, size_t slotCount)
+   {
+      return static_cast<size_t>(mix(hash, seeds[bucket(hash, bucketCount)]) & (slotCount - 1));
+   }
+}
\ No newline at end of file
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "FrozenMap.hpp"
+
+namespace comp
+{
+   // Values remembered by key for a time window, bounded by a capacity.
+   // An exact LRU holds them behind a mutex. In front of it, a bloom filter
+   // of two generations, swapped once per window, answers most lookups of
+   // unseen keys with a few atomic loads and without taking the lock.
+   template<typename Value>
+   class IdempotencyCache
+   {
+   public:
+
+      IdempotencyCache(size_t capacity, std::chrono::milliseconds window);
+
+      // false for keys never inserted, evicted or older than the window
+      bool find(const std::string& key, Value& value);
+      void insert(const std::string& key, const Value& value);
+      size_t size() const;
+
+   private:
+
+      using Clock = std::chrono::steady_clock;
+
+      struct Entry
+      {
+         std::string key;
+         Value value;
+         Clock::time_point stored;
+      };
+
+      // bloom probes per key
+      static constexpr unsigned Probes = 4;
+
+      bool mayContain(uint64_t hash) const;
+      void add(uint64_t hash);
+      // starts a new generation once the current one is a window old
+      void rotate(Clock::time_point now);
+
+      size_t m_capacity;
+      Clock::duration m_window;
+      // bits of a generation, a power of two
+      size_t m_bits;
+      std::unique_ptr<std::atomic<uint64_t>[]> m_generations[2];
+      std::atomic<unsigned> m_current{ 0 };
+      std::atomic<Clock::rep> m_rotated;
+
+      mutable std::mutex m_mutex;
+      // most recently used first
+      std::list<Entry> m_entries;
+      std::unordered_map<std::string, typename std::list<Entry>::iterator> m_index;
+   };
+
+   template<typename Value>
+   inline IdempotencyCache<Value>::IdempotencyCache(size_t capacity, std::chrono::milliseconds window) :
+      m_capacity(capacity > 0 ? capacity : 1),
+      m_window(window),
+      m_bits(64),
+      m_rotated(Clock::now().time_since_epoch().count())
+   {
+      // about ten bits per key keeps false positives near one percent
+      while (m_bits < m_capacity * 10)
+         m_bits *= 2;
+
+      for (auto& generation : m_generations)
+      {
+         generation.reset(new std::atomic<uint64_t>[m_bits / 64]);
+
+         for (size_t i = 0; i < m_bits / 64; ++i)
+            generation[i].store(0, std::memory_order_relaxed);
+      }
+
+      m_index.reserve(m_capacity);
+   }
+
+   template<typename Value>
+   inline bool IdempotencyCache<Value>::find(const std::string& key, Value& value)
+   {
+      auto now = Clock::now();
+      rotate(now);
+
+      if (!mayContain(PerfectHash::mix(PerfectHash::hash(key.data(), key.size()), 0)))
+         return false;
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_index.find(key);
+
+      if (it == m_index.end())
+         return false;
+
+      if (now - it->second->stored >= m_window)
+      {
+         m_entries.erase(it->second);
+         m_index.erase(it);
+         return false;
+      }
+
+      m_entries.splice(m_entries.begin(), m_entries, it->second);
+      value = it->second->value;
+      return true;
+   }
+
+   template<typename Value>
+   inline void IdempotencyCache<Value>::insert(const std::string& key, const Value& value)
+   {
+      auto now = Clock::now();
+      rotate(now);
+      add(PerfectHash::mix(PerfectHash::hash(key.data(), key.size()), 0));
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_index.find(key);
+
+      if (it != m_index.end())
+      {
+         it->second->value = value;
+         it->second->stored = now;
+         m_entries.splice(m_entries.begin(), m_entries, it->second);
+         return;
+      }
+
+      if (m_entries.size() == m_capacity)
+      {
+         m_index.erase(m_entries.back().key);
+         m_entries.pop_back();
+      }
+
+      m_entries.push_front({ key, value, now });
+      m_index.emplace(key, m_entries.begin());
+   }
+
+   template<typename Value>
+   inline size_t IdempotencyCache<Value>::size() const
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_entries.size();
+   }
+
+   template<typename Value>
+   inline bool IdempotencyCache<Value>::mayContain(uint64_t hash) const
+   {
+      auto first = static_cast<uint32_t>(hash);
+      auto step = static_cast<uint32_t>(hash >> 32) | 1;
+
+      for (auto const& generation : m_generations)
+      {
+         bool all = true;
+
+         for (unsigned i = 0; i < Probes && all; ++i)
+         {
+            size_t bit = (first + i * step) & (m_bits - 1);
+            all = (generation[bit / 64].load(std::memory_order_relaxed) & (1ull << (bit % 64))) != 0;
+         }
+
+         if (all)
+            return true;
+      }
+
+      return false;
+   }
+
+   template<typename Value>
+   inline void IdempotencyCache<Value>::add(uint64_t hash)
+   {
+      auto first = static_cast<uint32_t>(hash);
+      auto step = static_cast<uint32_t>(hash >> 32) | 1;
+      auto& generation = m_generations[m_current.load(std::memory_order_acquire)];
+
+      for (unsigned i = 0; i < Probes; ++i)
+      {
+         size_t bit = (first + i * step) & (m_bits - 1);
+         generation[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_relaxed);
+      }
+   }
+
+   template<typename Value>
+   inline void IdempotencyCache<Value>::rotate(Clock::time_point now)
+   {
+      auto rotated = m_rotated.load(std::memory_order_relaxed);
+
+      if (now.time_since_epoch().count() - rotated < m_window.count())
+         return;
+
+      // one thread clears the older generation, which only holds keys past the window
+      if (!m_rotated.compare_exchange_strong(rotated, now.time_since_epoch().count()))
+         return;
+
+      unsigned older = 1 - m_current.load(std::memory_order_relaxed);
+      auto& generation = m_generations[older];
+
+      for (size_t i = 0; i < m_bits / 64; ++i)
+         generation[i].store(0, std::memory_order_relaxed);
+
+      m_current.store(older, std::memory_order_release);
+   }
+}
\ No newline at end of file
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <cstdint>
+#include <limits>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <mutex>
+#include <condition_variable>
+#endif
+
+namespace comp
+{
+   // Event counter waiters can sleep on until somebody notifies it.
+   // Backed by a futex on Linux and a condition variable elsewhere.
+   class Futex
+   {
+   public:
+
+      uint32_t value() const;
+
+      // sleeps while the counter still equals the observed value
+      void wait(uint32_t observed);
+      void notifyOne();
+      void notifyAll();
+
+   private:
+
+      void notify(int count);
+
+      std::atomic<uint32_t> m_value{ 0 };
+      std::atomic<uint32_t> m_waiters{ 0 };
+#ifndef __linux__
+      std::mutex m_mutex;
+      std::condition_variable m_cond;
+#endif
+   };
+
+   // Bounded lock-free multi-producer multi-consumer queue (Vyukov's
+   // sequenced ring). Capacity is rounded up to a power of two.
+   template<typename T>
+   class MpmcQueue
+   {
+   public:
+
+      MpmcQueue(size_t capacity);
+
+      MpmcQueue(const MpmcQueue&) = delete;
+      MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+      bool tryPush(T&& value);
+
+      // enqueues every element or none of them, reserving the slots with a single CAS
+      template<typename Iterator>
+      bool tryPushBulk(Iterator first, size_t count);
+
+      bool tryPop(T& value);
+
+      size_t capacity() const;
+      size_t sizeApprox() const;
+
+   private:
+
+      struct Cell
+      {
+         std::atomic<size_t> seq;
+         T data;
+      };
+
+      static size_t roundUp(size_t value);
+
+      std::vector<Cell> m_cells;
+      size_t m_mask;
+      alignas(64) std::atomic<size_t> m_enqueuePos{ 0 };
+      alignas(64) std::atomic<size_t> m_dequeuePos{ 0 };
+   };
+
+   inline uint32_t Futex::value() const
+   {
+      return m_value.load(std::memory_order_acquire);
+   }
+
+   inline void Futex::wait(uint32_t observed)
+   {
+      m_waiters.fetch_add(1, std::memory_order_seq_cst);
+
+#ifdef __linux__
+      if (m_value.load(std::memory_order_seq_cst) == observed)
+         syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_value), FUTEX_WAIT_PRIVATE, observed, nullptr, nullptr, 0);
+#else
+      {
+         std::unique_lock<std::mutex> lock(m_mutex);
+         m_cond.wait(lock, [this, observed] { return m_value.load() != observed; });
+      }
+#endif
+
+      m_waiters.fetch_sub(1, std::memory_order_relaxed);
+   }
+
+   inline void Futex::notifyOne()
+   {
+      notify(1);
+   }
+
+   inline void Futex::notifyAll()
+   {
+      notify(std::numeric_limits<int>::max());
+   }
+
+   inline void Futex::notify(int count)
+   {
+      m_value.fetch_add(1, std::memory_order_seq_cst);
+
+      // producers skip the syscall entirely while nobody sleeps
+      if (m_waiters.load(std::memory_order_seq_cst) == 0)
+         return;
+
+#ifdef __linux__
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_value), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (count == 1)
+         m_cond.notify_one();
+      else
+         m_cond.notify_all();
+#endif
+   }
+
+   template<typename T>
+   inline MpmcQueue<T>::MpmcQueue(size_t capacity) :
+      m_cells(roundUp(capacity)),
+      m_mask(m_cells.size() - 1)
+   {
+      for (size_t i = 0; i < m_cells.size(); ++i)
+         m_cells[i].seq.store(i, std::memory_order_relaxed);
+   }
+
+   template<typename T>
+   inline bool MpmcQueue<T>::tryPush(T&& value)
+   {
+      size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+      Cell* cell;
+
+      for (;;)
+      {
+         cell = &m_cells[pos & m_mask];
+         size_t seq = cell->seq.load(std::memory_order_acquire);
+         intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+         if (diff == 0)
+         {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+               break;
+         }
+         else if (diff < 0)
+         {
+            return false;
+         }
+         else
+         {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+         }
+      }
+
+      cell->data = std::move(value);
+      cell->seq.store(pos + 1, std::memory_order_release);
+      return true;
+   }
+
+   template<typename T>
+   template<typename Iterator>
+   inline bool MpmcQueue<T>::tryPushBulk(Iterator first, size_t count)
+   {
+      if (count == 0)
+         return true;
+
+      if (count > m_cells.size())
+         return false;
+
+      size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+
+      for (;;)
+      {
+         size_t head = m_dequeuePos.load(std::memory_order_acquire);
+         intptr_t used = static_cast<intptr_t>(pos - head);
+
+         // consumers moved past a stale pos, which says nothing about the room left
+         if (used < 0)
+         {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+            continue;
+         }
+
+         if (static_cast<size_t>(used) + count > m_cells.size())
+            return false;
+
+         if (m_enqueuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+            break;
+      }
+
+      for (size_t i = 0; i < count; ++i, ++first)
+      {
+         Cell& cell = m_cells[(pos + i) & m_mask];
+
+         // the slot is already claimed by a consumer that may still be moving out of it
+         while (cell.seq.load(std::memory_order_acquire) != pos + i)
+            std::this_thread::yield();
+
+         cell.data = std::move(*first);
+         cell.seq.store(pos + i + 1, std::memory_order_release);
+      }
+
+      return true;
+   }
+
+   template<typename T>
+   inline bool MpmcQueue<T>::tryPop(T& value)
+   {
+      size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+      Cell* cell;
+
+      for (;;)
+      {
+         cell = &m_cells[pos & m_mask];
+         size_t seq = cell->seq.load(std::memory_order_acquire);
+         intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+         if (diff == 0)
+         {
+            if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+               break;
+         }
+         else if (diff < 0)
+         {
+            return false;
+         }
+         else
+         {
+            pos = m_dequeuePos.load(std::memory_order_relaxed);
+         }
+      }
+
+      value = std::move(cell->data);
+      cell->data = T();
+      cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+      return true;
+   }
+
+   template<typename T>
+   inline size_t MpmcQueue<T>::capacity() const
+   {
+      return m_cells.size();
+   }
+
+   template<typename T>
+   inline size_t MpmcQueue<T>::sizeApprox() const
+   {
+      size_t tail = m_enqueuePos.load(std::memory_order_relaxed);
+      size_t head = m_dequeuePos.load(std::memory_order_relaxed);
+      return (tail > head ? tail - head : 0);
+   }
+
+   template<typename T>
+   inline size_t MpmcQueue<T>::roundUp(size_t value)
+   {
+      if (value < 2)
+         return 2;
+
+      size_t res = 1;
+
+      while (res < value)
+         res <<= 1;
+
+      return res;
+   }
+}
\ No newline at end of file
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace comp
+{
+   struct PerfSample
+   {
+      uint64_t instructions{ 0 };
+      uint64_t cycles{ 0 };
+      uint64_t cacheMisses{ 0 };
+      uint64_t branchMisses{ 0 };
+
+      PerfSample operator-(const PerfSample& other) const;
+   };
+
+   // Hardware counters of one thread, opened as a single perf_event group
+   // so that they are scheduled together and read with one system call.
+   // Counters the kernel or hypervisor does not expose stay at zero; when
+   // not even cycles can be counted the group is unavailable.
+   class PerfCounters
+   {
+   public:
+
+      // counters of the calling thread, opened on first use
+      static PerfCounters& local();
+
+      PerfCounters(const PerfCounters&) = delete;
+      PerfCounters& operator=(const PerfCounters&) = delete;
+      ~PerfCounters();
+
+      bool available() const;
+      // false when unavailable or the read fails
+      bool read(PerfSample& sample) const;
+
+   private:
+
+      PerfCounters();
+
+      static constexpr int EventCount = 4;
+
+      int m_fds[EventCount];
+      // field of PerfSample each group member fills, in group order
+      uint64_t PerfSample::* m_fields[EventCount];
+      int m_count{ 0 };
+   };
+
+   inline PerfSample PerfSample::operator-(const PerfSample& other) const
+   {
+      return { instructions - other.instructions, cycles - other.cycles,
+         cacheMisses - other.cacheMisses, branchMisses - other.branchMisses };
+   }
+
+   inline PerfCounters& PerfCounters::local()
+   {
+      static thread_local PerfCounters counters;
+      return counters;
+   }
+
+   inline PerfCounters::PerfCounters()
+   {
+#ifdef __linux__
+      struct Event
+      {
+         uint64_t config;
+         uint64_t PerfSample::* field;
+      };
+
+      // the leader comes first, the group is useless without it
+      const Event events[EventCount] = {
+         { PERF_COUNT_HW_CPU_CYCLES, &PerfSample::cycles },
+         { PERF_COUNT_HW_INSTRUCTIONS, &PerfSample::instructions },
+         { PERF_COUNT_HW_CACHE_MISSES, &PerfSample::cacheMisses },
+         { PERF_COUNT_HW_BRANCH_MISSES, &PerfSample::branchMisses } };
+
+      for (auto const& event : events)
+      {
+         perf_event_attr attr;
+         std::memset(&attr, 0, sizeof(attr));
+         attr.size = sizeof(attr);
+         attr.type = PERF_TYPE_HARDWARE;
+         attr.config = event.config;
+         attr.read_format = PERF_FORMAT_GROUP;
+         attr.disabled = (m_count == 0);
+         // user space only, which unprivileged processes are usually allowed to count
+         attr.exclude_kernel = 1;
+         attr.exclude_hv = 1;
+
+         int leader = (m_count == 0 ? -1 : m_fds[0]);
+         int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC));
+
+         if (fd < 0)
+         {
+            if (m_count == 0)
+               return;
+
+            continue;
+         }
+
+         m_fds[m_count] = fd;
+         m_fields[m_count] = event.field;
+         ++m_count;
+      }
+
+      ioctl(m_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+   }
+
+   inline PerfCounters::~PerfCounters()
+   {
+#ifdef __linux__
+      for (int i = 0; i < m_count; ++i)
+         close(m_fds[i]);
+#endif
+   }
+
+   inline bool PerfCounters::available() const
+   {
+      return (m_count > 0);
+   }
+
+   inline bool PerfCounters::read(PerfSample& sample) const
+   {
+#ifdef __linux__
+      if (m_count == 0)
+         return false;
+
+      uint64_t values[1 + EventCount];
+      ssize_t size = ::read(m_fds[0], values, sizeof(uint64_t) * (1 + m_count));
+
+      if (size != static_cast<ssize_t>(sizeof(uint64_t) * (1 + m_count)) || values[0] != static_cast<uint64_t>(m_count))
+         return false;
+
+      sample = PerfSample();
+
+      for (int i = 0; i < m_count; ++i)
+         sample.*m_fields[i] = values[1 + i];
+
+      return true;
+#else
+      (void)sample;
+      return false;
+#endif
+   }
+}
\ No newline at end of file
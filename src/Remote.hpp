@@ -0,0 +1,774 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+
+#include <cerrno>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "CommandProcessor.hpp"
+#include "Encoding.hpp"
+#include "StatusWriter.hpp"
+
+namespace comp
+{
+   // Frames of the remote protocol, each led by its u32 little-endian payload size:
+   //    request: varint id, varint argument count, varint-prefixed arguments
+   //    reply:   varint id, varint status count, the statuses of the script
+   //             in StatusWriter's binary format numbered from zero
+   // Replies carry the id of their request and come in completion order.
+   class RemoteProtocol
+   {
+   public:
+
+      // larger frames close the connection
+      static constexpr size_t MaxFrame = 16 << 20;
+
+      static void request(std::string& out, uint64_t id, const ArgVec& args);
+      static void reply(std::string& out, uint64_t id, const std::vector<CommandStatus>& statuses);
+      // decode one payload, false when it is malformed
+      static bool request(const char* in, size_t size, uint64_t& id, ArgVec& args);
+      static bool reply(const char* in, size_t size, uint64_t& id, std::vector<CommandStatus>& statuses);
+
+      // writes everything, false once the peer is gone
+      static bool send(int fd, const std::string& data);
+
+      // buffered frame input from a socket
+      class Reader
+      {
+      public:
+
+         Reader(int fd);
+
+         // the payload stays valid until the next call; false on end of
+         // stream, error or an oversized frame
+         bool next(const char*& payload, size_t& size);
+         // next() without reading: false when no complete frame is buffered
+         bool buffered(const char*& payload, size_t& size);
+         // reads once from the socket, false on end of stream, error or an oversized frame
+         bool fill();
+
+      private:
+
+         int m_fd;
+         std::string m_buffer;
+         size_t m_pos{ 0 };
+         bool m_oversized{ false };
+      };
+
+   private:
+
+      // reserves the size field of a frame and returns its position
+      static size_t open(std::string& out);
+      static void close(std::string& out, size_t frame);
+   };
+
+   // Executes requests of RemoteClient connections on a started Commander.
+   // Each connection has a reader thread submitting its requests, so a
+   // client may pipeline any number of them, and a writer thread sending
+   // the replies as their scripts finish, so slow commands never hold back
+   // others and executor workers never wait on a socket. A full submission
+   // queue holds the reader back until it takes the request, as do
+   // MaxPending bytes of replies the client does not read: the client is
+   // then throttled by TCP flow control instead of getting errors.
+   class RemoteServer
+   {
+   public:
+
+      static constexpr size_t MaxPending = 16 << 20;
+
+      // port zero picks a free one
+      RemoteServer(Commander& commander, uint16_t port = 0, const std::string& address = "127.0.0.1");
+      ~RemoteServer();
+
+      RemoteServer(const RemoteServer&) = delete;
+      RemoteServer& operator=(const RemoteServer&) = delete;
+
+      uint16_t port() const;
+      // closes every connection, replies still pending are dropped
+      void stop();
+
+   private:
+
+      // outlives its threads while replies are pending
+      struct Connection
+      {
+         int fd;
+         std::mutex mutex;
+         // signals both threads: replies to write, room for more, the end
+         std::condition_variable wake;
+         // reply frames the writer has not taken yet
+         std::string pending;
+         // requests submitted whose reply is not pending yet
+         size_t outstanding{ 0 };
+         bool reading{ true };
+         // set once the peer is gone or the server stops; later replies are dropped
+         bool broken{ false };
+         // set by the writer, which finishes after the reader
+         std::atomic<bool> finished{ false };
+
+         ~Connection();
+         // hands a reply to the writer, never blocks on the socket
+         void post(const std::string& frame);
+      };
+
+      struct Session
+      {
+         std::shared_ptr<Connection> connection;
+         std::thread reader;
+         std::thread writer;
+      };
+
+      void accept();
+      // joins the threads of finished connections, m_mutex held
+      void collect();
+      void serve(const std::shared_ptr<Connection>& connection);
+      void write(const std::shared_ptr<Connection>& connection);
+
+      Commander& m_commander;
+      int m_fd;
+      uint16_t m_port;
+      std::atomic<bool> m_stopping{ false };
+      std::thread m_acceptor;
+      std::mutex m_mutex;
+      std::vector<Session> m_sessions;
+   };
+
+   // One connection to a RemoteServer. send() only buffers its request, so
+   // many requests go out in one write; receive() and call() write out the
+   // buffer before waiting. Replies arriving while requests are written are
+   // read aside, so a client pipelining more than the server lets pile up
+   // unread keeps the connection moving. Not thread-safe.
+   class RemoteClient
+   {
+   public:
+
+      struct Reply
+      {
+         uint64_t id;
+         std::vector<CommandStatus> statuses;
+      };
+
+      RemoteClient(uint16_t port, const std::string& address = "127.0.0.1");
+      ~RemoteClient();
+
+      RemoteClient(const RemoteClient&) = delete;
+      RemoteClient& operator=(const RemoteClient&) = delete;
+
+      // returns the id the reply will carry
+      uint64_t send(const ArgVec& args);
+      void flush();
+      // the next reply of any request in arrival order; throws once the connection is closed
+      Reply receive();
+      // waits for the reply to this request, replies to others wait for receive()
+      std::vector<CommandStatus> call(const ArgVec& args);
+
+   private:
+
+      static constexpr size_t FlushSize = 64 << 10;
+
+      Reply read();
+      // reads the replies that arrived into m_early without waiting for more
+      void drain();
+      // keeps a reply read ahead for receive() or call()
+      void stash(Reply&& reply);
+
+      int m_fd;
+      RemoteProtocol::Reader m_reader;
+      std::string m_out;
+      uint64_t m_next{ 0 };
+      // replies read ahead in arrival order, indexed by id for call()
+      std::list<Reply> m_early;
+      std::unordered_map<uint64_t, std::list<Reply>::iterator> m_earlyIds;
+   };
+
+   inline void RemoteProtocol::request(std::string& out, uint64_t id, const ArgVec& args)
+   {
+      size_t frame = open(out);
+      Encoding::varint(out, id);
+      Encoding::varint(out, args.size());
+
+      for (auto const& arg : args)
+      {
+         Encoding::varint(out, arg.size());
+         out += arg;
+      }
+
+      close(out, frame);
+   }
+
+   inline void RemoteProtocol::reply(std::string& out, uint64_t id, const std::vector<CommandStatus>& statuses)
+   {
+      size_t frame = open(out);
+      Encoding::varint(out, id);
+      Encoding::varint(out, statuses.size());
+
+      // three varints and the status byte per record
+      size_t capacity = 0;
+
+      for (auto const& stat : statuses)
+         capacity += 3 * Encoding::MaxVarint + 1 + stat.name.size() + stat.msg.size();
+
+      size_t start = out.size();
+      size_t next = 0;
+      out.resize(start + capacity);
+      StatusWriter writer(StatusWriter::Format::Binary);
+      out.resize(start + writer.write(statuses.data(), statuses.size(), next, &out[start], capacity));
+      close(out, frame);
+   }
+
+   inline bool RemoteProtocol::request(const char* in, size_t size, uint64_t& id, ArgVec& args)
+   {
+      const char* end = in + size;
+      uint64_t count = 0;
+
+      if (!Encoding::varint(in, end, id) || !Encoding::varint(in, end, count) || count > size)
+         return false;
+
+      args.resize(static_cast<size_t>(count));
+
+      for (auto& arg : args)
+      {
+         uint64_t length = 0;
+
+         if (!Encoding::varint(in, end, length) || length > static_cast<uint64_t>(end - in))
+            return false;
+
+         arg.assign(in, static_cast<size_t>(length));
+         in += length;
+      }
+
+      return (in == end);
+   }
+
+   inline bool RemoteProtocol::reply(const char* in, size_t size, uint64_t& id, std::vector<CommandStatus>& statuses)
+   {
+      const char* end = in + size;
+      uint64_t count = 0;
+
+      if (!Encoding::varint(in, end, id) || !Encoding::varint(in, end, count) || count > size)
+         return false;
+
+      statuses.resize(static_cast<size_t>(count));
+
+      for (auto& stat : statuses)
+      {
+         uint64_t sequence = 0;
+         size_t used = StatusWriter::read(in, static_cast<size_t>(end - in), stat, sequence);
+
+         if (used == 0)
+            return false;
+
+         in += used;
+      }
+
+      return (in == end);
+   }
+
+   inline bool RemoteProtocol::send(int fd, const std::string& data)
+   {
+      for (size_t done = 0; done < data.size();)
+      {
+         ssize_t count = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+
+         if (count < 0 && errno == EINTR)
+            continue;
+
+         if (count <= 0)
+            return false;
+
+         done += static_cast<size_t>(count);
+      }
+
+      return true;
+   }
+
+   inline size_t RemoteProtocol::open(std::string& out)
+   {
+      size_t frame = out.size();
+      out.append(4, '\0');
+      return frame;
+   }
+
+   inline void RemoteProtocol::close(std::string& out, size_t frame)
+   {
+      size_t size = out.size() - frame - 4;
+
+      for (int i = 0; i < 4; ++i)
+         out[frame + i] = static_cast<char>((size >> (i * 8)) & 0xFF);
+   }
+
+   inline RemoteProtocol::Reader::Reader(int fd) :
+      m_fd(fd)
+   {}
+
+   inline bool RemoteProtocol::Reader::next(const char*& payload, size_t& size)
+   {
+      while (!buffered(payload, size))
+      {
+         if (!fill())
+            return false;
+      }
+
+      return true;
+   }
+
+   inline bool RemoteProtocol::Reader::buffered(const char*& payload, size_t& size)
+   {
+      size_t available = m_buffer.size() - m_pos;
+
+      if (available < 4)
+         return false;
+
+      size = 0;
+
+      for (int i = 0; i < 4; ++i)
+         size |= static_cast<size_t>(static_cast<unsigned char>(m_buffer[m_pos + i])) << (i * 8);
+
+      if (size > MaxFrame)
+      {
+         m_oversized = true;
+         return false;
+      }
+
+      if (available < 4 + size)
+         return false;
+
+      payload = m_buffer.data() + m_pos + 4;
+      m_pos += 4 + size;
+      return true;
+   }
+
+   inline bool RemoteProtocol::Reader::fill()
+   {
+      if (m_oversized)
+         return false;
+
+      // keep the partial frame at the front and read more behind it
+      m_buffer.erase(0, m_pos);
+      m_pos = 0;
+
+      for (;;)
+      {
+         size_t used = m_buffer.size();
+         m_buffer.resize(used + (64 << 10));
+         ssize_t count = ::recv(m_fd, &m_buffer[used], m_buffer.size() - used, 0);
+         m_buffer.resize(used + (count > 0 ? static_cast<size_t>(count) : 0));
+
+         if (count < 0 && errno == EINTR)
+            continue;
+
+         return (count > 0);
+      }
+   }
+
+   inline RemoteServer::RemoteServer(Commander& commander, uint16_t port, const std::string& address) :
+      m_commander(commander),
+      m_fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)),
+      m_port(port)
+   {
+      sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port);
+      int reuse = 1;
+      socklen_t length = sizeof(addr);
+
+      if (m_fd < 0 || inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+         setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+         bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(m_fd, SOMAXCONN) != 0 ||
+         getsockname(m_fd, reinterpret_cast<sockaddr*>(&addr), &length) != 0)
+      {
+         if (m_fd >= 0)
+            ::close(m_fd);
+
+         throw std::runtime_error("cannot listen on \"" + address + ":" + std::to_string(port) + "\"");
+      }
+
+      m_port = ntohs(addr.sin_port);
+      m_acceptor = std::thread([this] { accept(); });
+   }
+
+   inline RemoteServer::~RemoteServer()
+   {
+      stop();
+   }
+
+   inline uint16_t RemoteServer::port() const
+   {
+      return m_port;
+   }
+
+   inline void RemoteServer::stop()
+   {
+      if (m_stopping.exchange(true))
+         return;
+
+      // wakes the acceptor and the readers blocked in their calls
+      shutdown(m_fd, SHUT_RDWR);
+      m_acceptor.join();
+      ::close(m_fd);
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      for (auto& session : m_sessions)
+      {
+         {
+            std::lock_guard<std::mutex> guard(session.connection->mutex);
+            session.connection->broken = true;
+            session.connection->wake.notify_all();
+         }
+
+         shutdown(session.connection->fd, SHUT_RDWR);
+         session.reader.join();
+         session.writer.join();
+      }
+
+      m_sessions.clear();
+   }
+
+   inline void RemoteServer::accept()
+   {
+      for (;;)
+      {
+         int fd = ::accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+         if (fd < 0)
+         {
+            if (m_stopping.load())
+               return;
+
+            if (errno == EINTR || errno == ECONNABORTED)
+               continue;
+
+            // out of descriptors or memory: free those of closed connections and
+            // wait, since retrying at once would spin until some are released
+            {
+               std::lock_guard<std::mutex> lock(m_mutex);
+               collect();
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+         }
+
+         int nodelay = 1;
+         setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+         auto connection = std::make_shared<Connection>();
+         connection->fd = fd;
+
+         std::lock_guard<std::mutex> lock(m_mutex);
+
+         if (m_stopping.load())
+            return;
+
+         // threads of closed connections are collected as new ones arrive
+         collect();
+
+         m_sessions.push_back({ connection, std::thread([this, connection] { serve(connection); }),
+            std::thread([this, connection] { write(connection); }) });
+      }
+   }
+
+   inline void RemoteServer::collect()
+   {
+      for (size_t i = 0; i < m_sessions.size();)
+      {
+         if (m_sessions[i].connection->finished.load())
+         {
+            m_sessions[i].reader.join();
+            m_sessions[i].writer.join();
+            m_sessions[i] = std::move(m_sessions.back());
+            m_sessions.pop_back();
+         }
+         else
+         {
+            ++i;
+         }
+      }
+   }
+
+   inline void RemoteServer::serve(const std::shared_ptr<Connection>& connection)
+   {
+      RemoteProtocol::Reader reader(connection->fd);
+      const char* payload;
+      size_t size;
+      uint64_t id;
+      ArgVec args;
+
+      while (reader.next(payload, size) && RemoteProtocol::request(payload, size, id, args))
+      {
+         {
+            std::unique_lock<std::mutex> lock(connection->mutex);
+            connection->wake.wait(lock, [&connection] { return connection->pending.size() < MaxPending || connection->broken; });
+
+            if (connection->broken)
+               break;
+
+            ++connection->outstanding;
+         }
+
+         auto done = [connection, id](std::vector<CommandStatus>& statuses)
+         {
+            std::string frame;
+            RemoteProtocol::reply(frame, id, statuses);
+            connection->post(frame);
+         };
+
+         bool accepted = false;
+
+         try
+         {
+            // a full queue holds the request back rather than failing it
+            accepted = m_commander.submit(args, done);
+
+            for (auto delay = std::chrono::microseconds(10); !accepted && !m_stopping.load();
+               delay = std::min(delay * 2, std::chrono::microseconds(1000)))
+            {
+               std::this_thread::sleep_for(delay);
+               accepted = m_commander.submit(args, done);
+            }
+         }
+         catch (const std::exception& ex)
+         {
+            // a request that cannot even be prepared fails alone, the connection goes on
+            std::vector<CommandStatus> statuses = { CommandStatus(args.empty() ? "" : args.front(), CommandStatus::ERROR, ex.what()) };
+            done(statuses);
+            continue;
+         }
+
+         if (!accepted)
+         {
+            std::lock_guard<std::mutex> lock(connection->mutex);
+            --connection->outstanding;
+            break;
+         }
+      }
+
+      std::lock_guard<std::mutex> lock(connection->mutex);
+      connection->reading = false;
+      connection->wake.notify_all();
+   }
+
+   inline void RemoteServer::write(const std::shared_ptr<Connection>& connection)
+   {
+      std::string frames;
+      std::unique_lock<std::mutex> lock(connection->mutex);
+
+      for (;;)
+      {
+         connection->wake.wait(lock, [&connection]
+         {
+            return !connection->pending.empty() || connection->broken
+               || (!connection->reading && connection->outstanding == 0);
+         });
+
+         if (connection->broken || connection->pending.empty())
+            break;
+
+         frames.swap(connection->pending);
+         connection->wake.notify_all();
+         lock.unlock();
+
+         bool sent = RemoteProtocol::send(connection->fd, frames);
+         frames.clear();
+         lock.lock();
+
+         if (!sent)
+         {
+            connection->broken = true;
+            connection->pending.clear();
+            connection->wake.notify_all();
+         }
+      }
+
+      // a reader blocked on the socket returns once it is shut down
+      shutdown(connection->fd, SHUT_RDWR);
+      connection->wake.wait(lock, [&connection] { return !connection->reading; });
+      connection->finished = true;
+   }
+
+   inline RemoteServer::Connection::~Connection()
+   {
+      ::close(fd);
+   }
+
+   inline void RemoteServer::Connection::post(const std::string& frame)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      --outstanding;
+
+      if (!broken)
+         pending += frame;
+
+      wake.notify_all();
+   }
+
+   inline RemoteClient::RemoteClient(uint16_t port, const std::string& address) :
+      m_fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)),
+      m_reader(m_fd)
+   {
+      sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port);
+      int nodelay = 1;
+
+      if (m_fd < 0 || inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+         connect(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+      {
+         if (m_fd >= 0)
+            ::close(m_fd);
+
+         throw std::runtime_error("cannot connect to \"" + address + ":" + std::to_string(port) + "\"");
+      }
+
+      setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+   }
+
+   inline RemoteClient::~RemoteClient()
+   {
+      ::close(m_fd);
+   }
+
+   inline uint64_t RemoteClient::send(const ArgVec& args)
+   {
+      uint64_t id = m_next++;
+      RemoteProtocol::request(m_out, id, args);
+
+      if (m_out.size() >= FlushSize)
+         flush();
+
+      return id;
+   }
+
+   inline void RemoteClient::flush()
+   {
+      for (size_t done = 0; done < m_out.size();)
+      {
+         pollfd ready{ m_fd, POLLIN | POLLOUT, 0 };
+
+         if (poll(&ready, 1, -1) < 0)
+         {
+            if (errno == EINTR)
+               continue;
+
+            throw std::runtime_error("remote connection closed");
+         }
+
+         // the server stops reading while its replies go unread
+         if (ready.revents & POLLIN)
+            drain();
+
+         if (ready.revents & (POLLOUT | POLLERR | POLLHUP))
+         {
+            ssize_t count = ::send(m_fd, m_out.data() + done, m_out.size() - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if (count < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+               continue;
+
+            if (count <= 0)
+               throw std::runtime_error("remote connection closed");
+
+            done += static_cast<size_t>(count);
+         }
+      }
+
+      m_out.clear();
+   }
+
+   inline RemoteClient::Reply RemoteClient::receive()
+   {
+      if (!m_early.empty())
+      {
+         Reply res = std::move(m_early.front());
+         m_earlyIds.erase(res.id);
+         m_early.pop_front();
+         return res;
+      }
+
+      flush();
+      return read();
+   }
+
+   inline std::vector<CommandStatus> RemoteClient::call(const ArgVec& args)
+   {
+      uint64_t id = send(args);
+      flush();
+
+      // the reply may have been read aside while the request went out
+      auto early = m_earlyIds.find(id);
+
+      if (early != m_earlyIds.end())
+      {
+         std::vector<CommandStatus> res = std::move(early->second->statuses);
+         m_early.erase(early->second);
+         m_earlyIds.erase(early);
+         return res;
+      }
+
+      for (;;)
+      {
+         Reply res = read();
+
+         if (res.id == id)
+            return std::move(res.statuses);
+
+         stash(std::move(res));
+      }
+   }
+
+   inline RemoteClient::Reply RemoteClient::read()
+   {
+      const char* payload;
+      size_t size;
+      Reply res;
+
+      if (!m_reader.next(payload, size) || !RemoteProtocol::reply(payload, size, res.id, res.statuses))
+         throw std::runtime_error("remote connection closed");
+
+      return res;
+   }
+
+   inline void RemoteClient::drain()
+   {
+      const char* payload;
+      size_t size;
+
+      if (!m_reader.fill())
+         throw std::runtime_error("remote connection closed");
+
+      while (m_reader.buffered(payload, size))
+      {
+         Reply res;
+
+         if (!RemoteProtocol::reply(payload, size, res.id, res.statuses))
+            throw std::runtime_error("remote connection closed");
+
+         stash(std::move(res));
+      }
+   }
+
+   inline void RemoteClient::stash(Reply&& reply)
+   {
+      uint64_t id = reply.id;
+      m_early.push_back(std::move(reply));
+      m_earlyIds[id] = std::prev(m_early.end());
+   }
+}
\ No newline at end of file
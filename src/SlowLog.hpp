@@ -0,0 +1,153 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+
+namespace comp
+{
+   struct SlowCommand
+   {
+      std::string name;
+      std::vector<std::string> args;
+      std::chrono::nanoseconds parseTime{ 0 };
+      std::chrono::nanoseconds executionTime{ 0 };
+      std::thread::id thread;
+      std::chrono::system_clock::time_point time;
+      // more than one when the call ran a coalesced batch, args are the first command's
+      size_t invocations{ 1 };
+   };
+
+   // Bounded ring of the latest slow commands, optionally mirrored to a
+   // file. Only slow commands ever reach it, so a mutex is enough.
+   class SlowLog
+   {
+   public:
+
+      SlowLog(size_t capacity = 256);
+
+      // the oldest entry makes room once the ring is full
+      void record(SlowCommand entry);
+      // oldest first
+      std::vector<SlowCommand> entries() const;
+      // entries recorded since construction, including those overwritten
+      size_t total() const;
+      void clear();
+
+      // appends every later entry as a text line to the file, an empty path stops it
+      void open(const std::string& path);
+      // writes buffered lines through to the file
+      void flush();
+
+   private:
+
+      static std::string format(const SlowCommand& entry);
+
+      mutable std::mutex m_mutex;
+      std::vector<SlowCommand> m_ring;
+      size_t m_capacity;
+      size_t m_total{ 0 };
+      std::ofstream m_file;
+   };
+
+   inline SlowLog::SlowLog(size_t capacity) :
+      m_capacity(capacity > 0 ? capacity : 1)
+   {}
+
+   inline void SlowLog::record(SlowCommand entry)
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_file.is_open())
+         m_file << format(entry) << '\n';
+
+      if (m_ring.size() < m_capacity)
+         m_ring.push_back(std::move(entry));
+      else
+         m_ring[m_total % m_capacity] = std::move(entry);
+
+      ++m_total;
+   }
+
+   inline std::vector<SlowCommand> SlowLog::entries() const
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_ring.size() < m_capacity)
+         return m_ring;
+
+      std::vector<SlowCommand> res;
+      res.reserve(m_capacity);
+
+      for (size_t i = 0; i < m_capacity; ++i)
+         res.push_back(m_ring[(m_total + i) % m_capacity]);
+
+      return res;
+   }
+
+   inline size_t SlowLog::total() const
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_total;
+   }
+
+   inline void SlowLog::clear()
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_ring.clear();
+      m_total = 0;
+   }
+
+   inline void SlowLog::open(const std::string& path)
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_file.is_open())
+         m_file.close();
+
+      if (path.empty())
+         return;
+
+      m_file.open(path, std::ios::out | std::ios::app);
+
+      if (!m_file)
+         throw std::runtime_error("cannot open slow log \"" + path + "\"");
+   }
+
+   inline void SlowLog::flush()
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_file.is_open())
+         m_file.flush();
+   }
+
+   inline std::string SlowLog::format(const SlowCommand& entry)
+   {
+      using std::chrono::duration_cast;
+      using std::chrono::microseconds;
+      using std::chrono::milliseconds;
+
+      auto since = entry.time.time_since_epoch();
+      std::string res = std::to_string(duration_cast<milliseconds>(since).count());
+
+      res += " thread=" + std::to_string(std::hash<std::thread::id>()(entry.thread));
+      res += " parse=" + std::to_string(duration_cast<microseconds>(entry.parseTime).count()) + "us";
+      res += " exec=" + std::to_string(duration_cast<microseconds>(entry.executionTime).count()) + "us";
+
+      if (entry.invocations > 1)
+         res += " batch=" + std::to_string(entry.invocations);
+
+      res += " command=" + entry.name + " args=";
+
+      for (size_t i = 0; i < entry.args.size(); ++i)
+         res += (i > 0 ? " " : "") + entry.args[i];
+
+      return res;
+   }
+}
\ No newline at end of file
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "CommandProcessor.hpp"
+#include "Encoding.hpp"
+
+namespace comp
+{
+   // Encodes streams of statuses into caller-provided buffers without
+   // intermediate strings. Every record carries its sequence number in the
+   // stream, so readers notice gaps left by dropped statuses.
+   //    JsonLines: {"seq":0,"name":"set","status":"OK","msg":""}\n
+   //    Binary:    varint seq, status byte, varint name size, name,
+   //               varint msg size, msg
+   class StatusWriter
+   {
+   public:
+
+      enum class Format
+      {
+         JsonLines,
+         Binary
+      };
+
+      StatusWriter(Format format, uint64_t sequence = 0);
+
+      // Encodes whole records of stats[next, count) into out until the
+      // next one does not fit, advances next past them and returns the
+      // bytes used. A record larger than the whole buffer is never written.
+      size_t write(const CommandStatus* stats, size_t count, size_t& next, char* out, size_t capacity);
+      // sequence number of the next record
+      uint64_t sequence() const;
+
+      // Decodes one binary record, returns the bytes it took or zero when
+      // the input holds no complete record or an unknown status
+      static size_t read(const char* in, size_t size, CommandStatus& stat, uint64_t& sequence);
+
+   private:
+
+      // bounds-checked output; a failed write leaves it failed
+      struct Cursor
+      {
+         char* pos;
+         char* end;
+         bool ok;
+
+         void put(char ch);
+         void put(const char* data, size_t size);
+         void number(uint64_t value);
+         void varint(uint64_t value);
+         void escaped(const std::string& value);
+      };
+
+      void json(const CommandStatus& stat, Cursor& out) const;
+      void binary(const CommandStatus& stat, Cursor& out) const;
+
+      Format m_format;
+      uint64_t m_sequence;
+   };
+
+   inline StatusWriter::StatusWriter(Format format, uint64_t sequence) :
+      m_format(format),
+      m_sequence(sequence)
+   {}
+
+   inline size_t StatusWriter::write(const CommandStatus* stats, size_t count, size_t& next, char* out, size_t capacity)
+   {
+      Cursor cursor{ out, out + capacity, true };
+
+      while (next < count)
+      {
+         char* start = cursor.pos;
+
+         if (m_format == Format::JsonLines)
+            json(stats[next], cursor);
+         else
+            binary(stats[next], cursor);
+
+         if (!cursor.ok)
+         {
+            cursor.pos = start;
+            break;
+         }
+
+         ++next;
+         ++m_sequence;
+      }
+
+      return static_cast<size_t>(cursor.pos - out);
+   }
+
+   inline uint64_t StatusWriter::sequence() const
+   {
+      return m_sequence;
+   }
+
+   inline size_t StatusWriter::read(const char* in, size_t size, CommandStatus& stat, uint64_t& sequence)
+   {
+      const char* pos = in;
+      const char* end = in + size;
+      uint64_t nameSize;
+      uint64_t msgSize;
+
+      if (!Encoding::varint(pos, end, sequence) || pos == end || static_cast<unsigned char>(*pos) > CommandStatus::TIMEOUT)
+         return 0;
+
+      auto status = static_cast<CommandStatus::Status>(static_cast<unsigned char>(*pos++));
+
+      if (!Encoding::varint(pos, end, nameSize) || nameSize > static_cast<uint64_t>(end - pos))
+         return 0;
+
+      const char* name = pos;
+      pos += nameSize;
+
+      if (!Encoding::varint(pos, end, msgSize) || msgSize > static_cast<uint64_t>(end - pos))
+         return 0;
+
+      stat.name.assign(name, static_cast<size_t>(nameSize));
+      stat.status = status;
+      stat.msg.assign(pos, static_cast<size_t>(msgSize));
+      pos += msgSize;
+      return static_cast<size_t>(pos - in);
+   }
+
+   inline void StatusWriter::json(const CommandStatus& stat, Cursor& out) const
+   {
+      const char* status = Encoding::statusName(stat.status);
+
+      out.put("{\"seq\":", 7);
+      out.number(m_sequence);
+      out.put(",\"name\":\"", 9);
+      out.escaped(stat.name);
+      out.put("\",\"status\":\"", 12);
+      out.put(status, std::strlen(status));
+      out.put("\",\"msg\":\"", 9);
+      out.escaped(stat.msg);
+      out.put("\"}\n", 3);
+   }
+
+   inline void StatusWriter::binary(const CommandStatus& stat, Cursor& out) const
+   {
+      out.varint(m_sequence);
+      out.put(static_cast<char>(stat.status));
+      out.varint(stat.name.size());
+      out.put(stat.name.data(), stat.name.size());
+      out.varint(stat.msg.size());
+      out.put(stat.msg.data(), stat.msg.size());
+   }
+
+   inline void StatusWriter::Cursor::put(char ch)
+   {
+      if (pos == end)
+      {
+         ok = false;
+         return;
+      }
+
+      *pos++ = ch;
+   }
+
+   inline void StatusWriter::Cursor::put(const char* data, size_t size)
+   {
+      if (static_cast<size_t>(end - pos) < size)
+      {
+         ok = false;
+         pos = end;
+         return;
+      }
+
+      std::memcpy(pos, data, size);
+      pos += size;
+   }
+
+   inline void StatusWriter::Cursor::number(uint64_t value)
+   {
+      static const char digits[] =
+         "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+         "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+         "8081828384858687888990919293949596979899";
+
+      // filled from the back, two digits per division
+      char buffer[20];
+      char* first = buffer + sizeof(buffer);
+
+      while (value >= 100)
+      {
+         unsigned pair = static_cast<unsigned>(value % 100) * 2;
+         value /= 100;
+         *--first = digits[pair + 1];
+         *--first = digits[pair];
+      }
+
+      if (value >= 10)
+      {
+         unsigned pair = static_cast<unsigned>(value) * 2;
+         *--first = digits[pair + 1];
+         *--first = digits[pair];
+      }
+      else
+      {
+         *--first = static_cast<char>('0' + value);
+      }
+
+      put(first, static_cast<size_t>(buffer + sizeof(buffer) - first));
+   }
+
+   inline void StatusWriter::Cursor::varint(uint64_t value)
+   {
+      char buffer[Encoding::MaxVarint];
+      put(buffer, Encoding::varint(value, buffer));
+   }
+
+   inline void StatusWriter::Cursor::escaped(const std::string& value)
+   {
+      static const char hex[] = "0123456789abcdef";
+      const char* data = value.data();
+      const char* stop = data + value.size();
+
+      while (data != stop)
+      {
+         // copy the longest run that needs no escaping at once
+         const char* run = data;
+
+         while (run != stop && static_cast<unsigned char>(*run) >= 0x20 && *run != '"' && *run != '\\')
+            ++run;
+
+         put(data, static_cast<size_t>(run - data));
+         data = run;
+
+         if (data == stop)
+            break;
+
+         auto ch = static_cast<unsigned char>(*data++);
+
+         switch (ch)
+         {
+         case '"': put("\\\"", 2); break;
+         case '\\': put("\\\\", 2); break;
+         case '\n': put("\\n", 2); break;
+         case '\r': put("\\r", 2); break;
+         case '\t': put("\\t", 2); break;
+         case '\b': put("\\b", 2); break;
+         case '\f': put("\\f", 2); break;
+         default:
+         {
+            char escape[6] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+            put(escape, sizeof(escape));
+         }
+         }
+      }
+   }
+}
\ No newline at end of file
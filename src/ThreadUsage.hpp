@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+namespace comp
+{
+   struct ThreadSample
+   {
+      std::chrono::nanoseconds cpuTime{ 0 };
+      uint64_t voluntarySwitches{ 0 };
+      uint64_t involuntarySwitches{ 0 };
+      uint64_t minorFaults{ 0 };
+      uint64_t majorFaults{ 0 };
+
+      ThreadSample operator-(const ThreadSample& other) const;
+   };
+
+   // Kernel accounting of the calling thread: CPU time from
+   // CLOCK_THREAD_CPUTIME_ID, context switches and page faults from
+   // getrusage(RUSAGE_THREAD). Each read costs two system calls.
+   class ThreadUsage
+   {
+   public:
+
+      // false where per-thread accounting is unsupported
+      static bool read(ThreadSample& sample);
+   };
+
+   inline ThreadSample ThreadSample::operator-(const ThreadSample& other) const
+   {
+      return { cpuTime - other.cpuTime, voluntarySwitches - other.voluntarySwitches,
+         involuntarySwitches - other.involuntarySwitches, minorFaults - other.minorFaults,
+         majorFaults - other.majorFaults };
+   }
+
+   inline bool ThreadUsage::read(ThreadSample& sample)
+   {
+#ifdef __linux__
+      timespec cpu;
+      rusage usage;
+
+      if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) != 0 || getrusage(RUSAGE_THREAD, &usage) != 0)
+         return false;
+
+      sample.cpuTime = std::chrono::seconds(cpu.tv_sec) + std::chrono::nanoseconds(cpu.tv_nsec);
+      sample.voluntarySwitches = static_cast<uint64_t>(usage.ru_nvcsw);
+      sample.involuntarySwitches = static_cast<uint64_t>(usage.ru_nivcsw);
+      sample.minorFaults = static_cast<uint64_t>(usage.ru_minflt);
+      sample.majorFaults = static_cast<uint64_t>(usage.ru_majflt);
+      return true;
+#else
+      (void)sample;
+      return false;
+#endif
+   }
+}
\ No newline at end of file
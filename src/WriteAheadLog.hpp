@@ -0,0 +1,554 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Encoding.hpp"
+
+namespace comp
+{
+   // Append-only journal of executed commands and their results with
+   // group commit: appends only fill a buffer, and a background thread
+   // writes it out and syncs the file with one fdatasync for every
+   // interval or every batch of records, whichever comes first.
+   // Frame: u32 payload size, u32 CRC-32 of the payload, payload.
+   // Payload: type byte, varint sequence, then for a command the varint
+   // argument count and varint-prefixed arguments, for a result the
+   // varint sequence of its command, the status byte and varint-prefixed
+   // name and message.
+   // Opening an existing log continues its sequence numbers and cuts off
+   // a torn or corrupt tail left by a crash. A failed write truncates the
+   // file back to its last complete batch and stops the log for good.
+   class WriteAheadLog
+   {
+   public:
+
+      struct Record
+      {
+         enum Type : uint8_t
+         {
+            Command,
+            Result
+         };
+
+         Type type;
+         uint64_t sequence;
+         // Command
+         std::vector<std::string> args;
+         // Result
+         uint64_t command;
+         int status;
+         std::string name;
+         std::string msg;
+      };
+
+      WriteAheadLog(const std::string& path, std::chrono::microseconds interval = std::chrono::microseconds(1000),
+         size_t batch = 256);
+      // syncs every record appended so far
+      ~WriteAheadLog();
+
+      WriteAheadLog(const WriteAheadLog&) = delete;
+      WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+      // commands are only run once their record is durable, at the cost of waiting for the next group commit
+      WriteAheadLog& waitBeforeRun(bool wait);
+      bool waitBeforeRun() const;
+
+      // both return the sequence number of the appended record
+      uint64_t command(const std::vector<std::string>& args);
+      uint64_t result(uint64_t command, int status, const std::string& name, const std::string& msg);
+
+      // blocks until the record is durable, throws when writing the log failed
+      void waitDurable(uint64_t sequence);
+      // syncs every record appended so far without waiting for the interval
+      void sync();
+      // records on disk, every sequence below it is durable
+      uint64_t durable() const;
+      size_t syncs() const;
+      // set once writing failed, later records are dropped
+      bool failed() const;
+
+      // Calls visit for every intact record of a log, stopping at the
+      // first torn or corrupt frame; returns the records visited
+      static size_t replay(const std::string& path, const std::function<void(const Record& record)>& visit);
+
+   private:
+
+      enum class Frame
+      {
+         Complete,
+         // more bytes are needed
+         Partial,
+         Corrupt
+      };
+
+      // Visits the intact records of a file and returns the size they
+      // take. Reads it in chunks and only holds one chunk and the frame
+      // crossing into it, so memory does not grow with the log.
+      static uint64_t scan(int fd, const std::string& path, const std::function<void(const Record& record)>& visit);
+      // decodes the frame at pos, remaining counts the bytes left in the file from there
+      static Frame decode(const char*& pos, const char* end, uint64_t remaining, Record& record);
+      // scans an existing log, cuts it after its last intact record and continues its numbering
+      void recover(const std::string& path);
+
+      static uint32_t crc(const char* data, size_t size);
+      static void string(std::string& out, const std::string& value);
+      static bool string(const char*& in, const char* end, std::string& value);
+
+      // frames the payload built by fill, called with the mutex held
+      template<typename Fill>
+      uint64_t append(Record::Type type, Fill fill);
+      void run();
+      bool flush(const std::string& data);
+
+      int m_fd;
+      // bytes of complete batches in the file
+      uint64_t m_size{ 0 };
+      std::chrono::microseconds m_interval;
+      size_t m_batch;
+      bool m_waitBeforeRun{ false };
+
+      mutable std::mutex m_mutex;
+      std::condition_variable m_wake;
+      std::condition_variable m_synced;
+      std::string m_buffer;
+      std::string m_payload;
+      size_t m_pending{ 0 };
+      uint64_t m_next{ 0 };
+      uint64_t m_durable{ 0 };
+      size_t m_syncs{ 0 };
+      bool m_syncRequested{ false };
+      bool m_stopping{ false };
+      bool m_failed{ false };
+      std::thread m_thread;
+   };
+
+   inline WriteAheadLog::WriteAheadLog(const std::string& path, std::chrono::microseconds interval, size_t batch) :
+      m_fd(open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)),
+      m_interval(interval),
+      m_batch(batch > 0 ? batch : 1)
+   {
+      if (m_fd < 0)
+         throw std::runtime_error("cannot open write-ahead log \"" + path + "\"");
+
+      try
+      {
+         recover(path);
+      }
+      catch (...)
+      {
+         close(m_fd);
+         throw;
+      }
+
+      m_thread = std::thread([this] { run(); });
+   }
+
+   inline WriteAheadLog::~WriteAheadLog()
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_stopping = true;
+      }
+
+      m_wake.notify_one();
+      m_thread.join();
+      close(m_fd);
+   }
+
+   inline WriteAheadLog& WriteAheadLog::waitBeforeRun(bool wait)
+   {
+      m_waitBeforeRun = wait;
+      return *this;
+   }
+
+   inline bool WriteAheadLog::waitBeforeRun() const
+   {
+      return m_waitBeforeRun;
+   }
+
+   inline uint64_t WriteAheadLog::command(const std::vector<std::string>& args)
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      return append(Record::Command, [&args](std::string& out)
+      {
+         Encoding::varint(out, args.size());
+
+         for (auto const& arg : args)
+            string(out, arg);
+      });
+   }
+
+   inline uint64_t WriteAheadLog::result(uint64_t command, int status, const std::string& name, const std::string& msg)
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      return append(Record::Result, [&](std::string& out)
+      {
+         Encoding::varint(out, command);
+         out += static_cast<char>(status);
+         string(out, name);
+         string(out, msg);
+      });
+   }
+
+   inline void WriteAheadLog::waitDurable(uint64_t sequence)
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_synced.wait(lock, [this, sequence] { return m_durable > sequence || m_failed; });
+
+      if (m_failed)
+         throw std::runtime_error("write-ahead log failed to write");
+   }
+
+   inline void WriteAheadLog::sync()
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if (m_next == 0)
+         return;
+
+      uint64_t last = m_next - 1;
+      m_syncRequested = true;
+      m_wake.notify_one();
+      lock.unlock();
+      waitDurable(last);
+   }
+
+   inline uint64_t WriteAheadLog::durable() const
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_durable;
+   }
+
+   inline size_t WriteAheadLog::syncs() const
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_syncs;
+   }
+
+   inline bool WriteAheadLog::failed() const
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_failed;
+   }
+
+   inline void WriteAheadLog::recover(const std::string& path)
+   {
+      m_size = scan(m_fd, path, [this](const Record& record) { m_next = std::max(m_next, record.sequence + 1); });
+
+      struct stat info;
+
+      if (fstat(m_fd, &info) != 0)
+         throw std::runtime_error("cannot read write-ahead log \"" + path + "\"");
+
+      if (m_size < static_cast<uint64_t>(info.st_size) && (ftruncate(m_fd, static_cast<off_t>(m_size)) != 0 || fdatasync(m_fd) != 0))
+         throw std::runtime_error("cannot truncate write-ahead log \"" + path + "\"");
+
+      m_durable = m_next;
+   }
+
+   template<typename Fill>
+   inline uint64_t WriteAheadLog::append(Record::Type type, Fill fill)
+   {
+      uint64_t sequence = m_next++;
+
+      m_payload.clear();
+      m_payload += static_cast<char>(type);
+      Encoding::varint(m_payload, sequence);
+      fill(m_payload);
+
+      uint32_t header[2] = { static_cast<uint32_t>(m_payload.size()), crc(m_payload.data(), m_payload.size()) };
+
+      for (uint32_t field : header)
+      {
+         for (int i = 0; i < 4; ++i)
+            m_buffer += static_cast<char>((field >> (i * 8)) & 0xFF);
+      }
+
+      m_buffer += m_payload;
+
+      if (++m_pending >= m_batch)
+         m_wake.notify_one();
+
+      return sequence;
+   }
+
+   inline void WriteAheadLog::run()
+   {
+      std::string data;
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      for (;;)
+      {
+         m_wake.wait_for(lock, m_interval, [this] { return m_stopping || m_syncRequested || m_pending >= m_batch; });
+
+         if (m_buffer.empty())
+         {
+            m_syncRequested = false;
+
+            if (m_stopping)
+               return;
+
+            continue;
+         }
+
+         // appends go on into the other buffer while this one is written
+         data.swap(m_buffer);
+         uint64_t upto = m_next;
+         m_pending = 0;
+         m_syncRequested = false;
+
+         // a failed log keeps the file as it was, records behind a torn frame could never be replayed
+         if (m_failed)
+         {
+            data.clear();
+            continue;
+         }
+
+         lock.unlock();
+         bool ok = flush(data);
+
+         if (ok)
+            m_size += data.size();
+         else if (ftruncate(m_fd, static_cast<off_t>(m_size)) == 0)
+            fdatasync(m_fd);
+
+         data.clear();
+         lock.lock();
+
+         if (ok)
+            m_durable = upto;
+         else
+            m_failed = true;
+
+         ++m_syncs;
+         m_synced.notify_all();
+      }
+   }
+
+   inline bool WriteAheadLog::flush(const std::string& data)
+   {
+      for (size_t done = 0; done < data.size();)
+      {
+         ssize_t count = ::write(m_fd, data.data() + done, data.size() - done);
+
+         if (count < 0 && errno == EINTR)
+            continue;
+
+         if (count <= 0)
+            return false;
+
+         done += static_cast<size_t>(count);
+      }
+
+      return (fdatasync(m_fd) == 0);
+   }
+
+   inline size_t WriteAheadLog::replay(const std::string& path, const std::function<void(const Record& record)>& visit)
+   {
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+      if (fd < 0)
+         throw std::runtime_error("cannot open write-ahead log \"" + path + "\"");
+
+      size_t count = 0;
+
+      try
+      {
+         scan(fd, path, [&visit, &count](const Record& record)
+         {
+            visit(record);
+            ++count;
+         });
+      }
+      catch (...)
+      {
+         close(fd);
+         throw;
+      }
+
+      close(fd);
+      return count;
+   }
+
+   inline uint64_t WriteAheadLog::scan(int fd, const std::string& path, const std::function<void(const Record& record)>& visit)
+   {
+      struct stat info;
+
+      if (fstat(fd, &info) != 0)
+         throw std::runtime_error("cannot read write-ahead log \"" + path + "\"");
+
+      uint64_t size = static_cast<uint64_t>(info.st_size);
+      // bytes of intact records before the window
+      uint64_t intact = 0;
+      std::string window;
+      std::vector<char> chunk(64 << 10);
+
+      for (uint64_t offset = 0; offset < size;)
+      {
+         ssize_t count = pread(fd, chunk.data(), chunk.size(), static_cast<off_t>(offset));
+
+         if (count < 0 && errno == EINTR)
+            continue;
+
+         if (count < 0)
+            throw std::runtime_error("cannot read write-ahead log \"" + path + "\"");
+
+         if (count == 0)
+            break;
+
+         window.append(chunk.data(), static_cast<size_t>(count));
+         offset += static_cast<uint64_t>(count);
+
+         const char* pos = window.data();
+         const char* end = pos + window.size();
+
+         for (;;)
+         {
+            const char* next = pos;
+            Record record{};
+            Frame frame = decode(next, end, size - intact - static_cast<uint64_t>(pos - window.data()), record);
+
+            if (frame == Frame::Corrupt)
+               return intact + static_cast<uint64_t>(pos - window.data());
+
+            if (frame == Frame::Partial)
+               break;
+
+            visit(record);
+            pos = next;
+         }
+
+         intact += static_cast<uint64_t>(pos - window.data());
+         window.erase(0, static_cast<size_t>(pos - window.data()));
+      }
+
+      // a frame still partial at the end of the file is torn
+      return intact;
+   }
+
+   inline WriteAheadLog::Frame WriteAheadLog::decode(const char*& pos, const char* end, uint64_t remaining, Record& record)
+   {
+      if (end - pos < 8)
+         return (remaining < 8 ? Frame::Corrupt : Frame::Partial);
+
+      uint32_t header[2] = { 0, 0 };
+
+      for (int field = 0; field < 2; ++field)
+      {
+         for (int i = 0; i < 4; ++i)
+            header[field] |= static_cast<uint32_t>(static_cast<unsigned char>(pos[field * 4 + i])) << (i * 8);
+      }
+
+      // a size running past the end of the file can only be a torn header
+      if (header[0] == 0 || header[0] > remaining - 8)
+         return Frame::Corrupt;
+
+      const char* payload = pos + 8;
+
+      if (header[0] > static_cast<size_t>(end - payload))
+         return Frame::Partial;
+
+      if (crc(payload, header[0]) != header[1])
+         return Frame::Corrupt;
+
+      const char* in = payload + 1;
+      const char* stop = payload + header[0];
+      record.type = static_cast<Record::Type>(payload[0]);
+      bool ok = Encoding::varint(in, stop, record.sequence);
+
+      if (ok && record.type == Record::Command)
+      {
+         uint64_t argc = 0;
+         ok = Encoding::varint(in, stop, argc);
+
+         for (uint64_t i = 0; ok && i < argc; ++i)
+         {
+            record.args.emplace_back();
+            ok = string(in, stop, record.args.back());
+         }
+      }
+      else if (ok && record.type == Record::Result)
+      {
+         ok = Encoding::varint(in, stop, record.command) && in != stop;
+
+         if (ok)
+         {
+            record.status = static_cast<unsigned char>(*in++);
+            ok = string(in, stop, record.name) && string(in, stop, record.msg);
+         }
+      }
+      else
+      {
+         ok = false;
+      }
+
+      if (!ok)
+         return Frame::Corrupt;
+
+      pos = stop;
+      return Frame::Complete;
+   }
+
+   inline uint32_t WriteAheadLog::crc(const char* data, size_t size)
+   {
+      // CRC-32 (IEEE 802.3), reflected
+      static const std::array<uint32_t, 256> table = []
+      {
+         std::array<uint32_t, 256> res{};
+
+         for (uint32_t i = 0; i < 256; ++i)
+         {
+            uint32_t value = i;
+
+            for (int bit = 0; bit < 8; ++bit)
+               value = (value & 1) ? (0xEDB88320u ^ (value >> 1)) : (value >> 1);
+
+            res[i] = value;
+         }
+
+         return res;
+      }();
+
+      uint32_t res = 0xFFFFFFFFu;
+
+      for (size_t i = 0; i < size; ++i)
+         res = table[(res ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (res >> 8);
+
+      return res ^ 0xFFFFFFFFu;
+   }
+
+   inline void WriteAheadLog::string(std::string& out, const std::string& value)
+   {
+      Encoding::varint(out, value.size());
+      out += value;
+   }
+
+   inline bool WriteAheadLog::string(const char*& in, const char* end, std::string& value)
+   {
+      uint64_t size = 0;
+
+      if (!Encoding::varint(in, end, size) || size > static_cast<uint64_t>(end - in))
+         return false;
+
+      value.assign(in, static_cast<size_t>(size));
+      in += size;
+      return true;
+   }
+}
\ No newline at end of file
@@ -0,0 +1,218 @@
+// Checks the paths declared allocation-free, reports what dispatch and
+// parsing allocate, times name lookup and argument parsing on their own,
+// and times dispatch through a mutable registry against a frozen one.
+// Fails when a checked path allocates; the reports and timings are only
+// printed.
+#define COMP_DEFINE_ALLOCATION_HOOKS
+#include "AllocationCounter.hpp"
+#include "CommandProcessor.hpp"
+
+#include <iostream>
+#include <unordered_map>
+
+using namespace comp;
+
+namespace
+{
+   constexpr size_t Commands = 200;
+   constexpr size_t Dispatches = 100000;
+   constexpr size_t Repetitions = 1000000;
+
+   CommandStatus go(const CommandArgs& args)
+   {
+      return CommandStatus(args.command());
+   }
+
+   CommandConfig config(const std::string& name)
+   {
+      CommandConfig config(name);
+      config.append(Option("-n").argSize(1));
+      config.append(Option("-v").argSize(1));
+      return config;
+   }
+
+   void fill(Commander& commander)
+   {
+      for (size_t i = 0; i < Commands; ++i)
+         commander.appendCommand(CommandCaller(go, config("cmd" + std::to_string(i))));
+   }
+
+   // nanoseconds per run() of a script spread over every command
+   double dispatch(Commander& commander)
+   {
+      std::vector<ArgVec> scripts;
+
+      for (size_t i = 0; i < Commands; ++i)
+         scripts.push_back({ "cmd" + std::to_string((i * 7919) % Commands), "-n", "5" });
+
+      for (auto const& script : scripts)
+         commander.run(script);
+
+      auto start = std::chrono::steady_clock::now();
+
+      for (size_t i = 0; i < Dispatches; ++i)
+         commander.run(scripts[i % Commands]);
+
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      return elapsed.count() / Dispatches;
+   }
+
+   // nanoseconds per call of fn, after a warm-up pass
+   template<typename Fn>
+   double time(size_t calls, Fn fn)
+   {
+      for (size_t i = 0; i < calls / 10; ++i)
+         fn(i);
+
+      auto start = std::chrono::steady_clock::now();
+
+      for (size_t i = 0; i < calls; ++i)
+         fn(i);
+
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      return elapsed.count() / calls;
+   }
+
+   // the two steps dispatch spends its time in, free of the registry and executor around them
+   void lookupAndParse()
+   {
+      std::vector<std::pair<std::string, int>> entries;
+
+      for (size_t i = 0; i < Commands; ++i)
+         entries.emplace_back("cmd" + std::to_string(i), static_cast<int>(i));
+
+      FrozenMap<int> frozenMap(entries.begin(), entries.end());
+      std::unordered_map<std::string, int> hashMap(entries.begin(), entries.end());
+      std::vector<std::string> names;
+
+      // half of the lookups miss, the way unknown arguments do
+      for (size_t i = 0; i < Commands; ++i)
+         names.push_back((i % 2 ? "cmd" : "arg") + std::to_string((i * 7919) % Commands));
+
+      volatile int sink = 0;
+
+      double frozenLookup = time(Repetitions, [&](size_t i)
+      {
+         const int* value = frozenMap.find(names[i % Commands]);
+         sink = (value ? *value : -1);
+      });
+
+      double hashLookup = time(Repetitions, [&](size_t i)
+      {
+         auto it = hashMap.find(names[i % Commands]);
+         sink = (it != hashMap.end() ? it->second : -1);
+      });
+
+      std::cout << "lookup, FrozenMap: " << frozenLookup << " ns\n";
+      std::cout << "lookup, unordered_map: " << hashLookup << " ns\n";
+
+      CommandConfig plain = config("go");
+      CommandConfig frozen = config("go");
+      frozen.freeze();
+      ArgVec args = { "go", "-n", "5", "-v", "7" };
+
+      double plainParse = time(Repetitions / 10, [&](size_t)
+      {
+         CommandArgs parsed(args, plain);
+         sink = static_cast<int>(parsed.getUInt("-n"));
+      });
+
+      double frozenParse = time(Repetitions / 10, [&](size_t)
+      {
+         CommandArgs parsed(args, frozen);
+         sink = static_cast<int>(parsed.getUInt("-n"));
+      });
+
+      std::cout << "parse, plain config: " << plainParse << " ns\n";
+      std::cout << "parse, frozen config: " << frozenParse << " ns\n";
+   }
+
+   void checkAllocations()
+   {
+      CommandConfig plain = config("go");
+      CommandConfig frozen = config("go");
+      frozen.freeze();
+
+      CommandArgs args(ArgVec{ "go", "-n", "5" }, plain);
+      CommandArgs frozenArgs(ArgVec{ "go", "-n", "5" }, frozen);
+      volatile uint32_t value = 0;
+
+      AllocationCounter::expectNone("CommandArgs::getUInt", [&] { value = args.getUInt("-n"); });
+      AllocationCounter::expectNone("CommandArgs::getUInt with a default", [&] { value = args.getUInt("-v", 1); });
+      AllocationCounter::expectNone("CommandArgs::getUInt on a frozen config", [&] { value = frozenArgs.getUInt("-n"); });
+      AllocationCounter::expectNone("CommandArgs::has", [&] { value = args.has("-v"); });
+
+      std::vector<std::pair<std::string, int>> entries;
+
+      for (size_t i = 0; i < Commands; ++i)
+         entries.emplace_back("cmd" + std::to_string(i), static_cast<int>(i));
+
+      FrozenMap<int> map(entries.begin(), entries.end());
+      std::string hit = "cmd42";
+      std::string miss = "unknown";
+
+      AllocationCounter::expectNone("FrozenMap::find", [&] { value = *map.find(hit) + (map.find(miss) != nullptr); });
+
+      IdempotencyCache<int> cache(1000, std::chrono::milliseconds(60000));
+      std::string unseen = "key";
+      int cached = 0;
+
+      AllocationCounter::expectNone("IdempotencyCache::find of an unseen key", [&] { value = cache.find(unseen, cached); });
+   }
+
+   void print(const std::string& path, const AllocationStats& stats)
+   {
+      std::cout << path << ": " << stats.allocationsPerCall() << " allocations, " << stats.bytesPerCall() << " bytes per call\n";
+   }
+
+   // paths that are not declared allocation-free, measured warmed up
+   void reportAllocations()
+   {
+      Commander commander;
+      fill(commander);
+      commander.freeze();
+
+      ArgVec script = { "cmd42", "-n", "5" };
+      print("Commander::run, frozen registry", AllocationCounter::measure([&] { commander.run(script); }));
+
+      CommandConfig plain = config("go");
+      CommandConfig frozen = config("go");
+      frozen.freeze();
+      ArgVec args = { "go", "-n", "5" };
+
+      print("CommandArgs parse", AllocationCounter::measure([&] { CommandArgs parsed(args, plain); }));
+      print("CommandArgs parse, frozen config", AllocationCounter::measure([&] { CommandArgs parsed(args, frozen); }));
+
+      CommandArgs parsed(args, plain);
+      volatile size_t size = 0;
+      print("CommandArgs::getString", AllocationCounter::measure([&] { size = parsed.getString("-n").size(); }));
+   }
+}
+
+int main()
+{
+   try
+   {
+      checkAllocations();
+      std::cout << "allocation-free paths: ok\n";
+      reportAllocations();
+      lookupAndParse();
+
+      Commander mutableRegistry;
+      fill(mutableRegistry);
+
+      Commander frozenRegistry;
+      fill(frozenRegistry);
+      frozenRegistry.freeze();
+
+      std::cout << "dispatch, mutable registry: " << dispatch(mutableRegistry) << " ns\n";
+      std::cout << "dispatch, frozen registry: " << dispatch(frozenRegistry) << " ns\n";
+   }
+   catch (const std::exception& ex)
+   {
+      std::cerr << ex.what() << "\n";
+      return 1;
+   }
+
+   return 0;
+}
\ No newline at end of file
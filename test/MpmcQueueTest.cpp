@@ -0,0 +1,154 @@
+// Checks MpmcQueue: bulk pushes are all-or-nothing, positions wrap around
+// the ring, and concurrent producers and consumers lose nothing.
+#include "MpmcQueue.hpp"
+
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace comp;
+
+namespace
+{
+   void check(bool condition, const std::string& what)
+   {
+      if (!condition)
+         throw std::runtime_error(what);
+   }
+
+   void bulkAllOrNothing()
+   {
+      MpmcQueue<int> queue(8);
+      std::vector<int> values = { 1, 2, 3, 4, 5, 6 };
+
+      check(queue.tryPushBulk(values.begin(), values.size()), "bulk push into an empty queue");
+      check(!queue.tryPushBulk(values.begin(), 3), "bulk push past the capacity succeeded");
+      check(queue.sizeApprox() == 6, "a failed bulk push enqueued part of its elements");
+      check(queue.tryPushBulk(values.begin(), 2), "bulk push filling the queue");
+      check(!queue.tryPushBulk(values.begin(), 9), "bulk push larger than the capacity succeeded");
+
+      int value = 0;
+
+      for (int expected : { 1, 2, 3, 4, 5, 6, 1, 2 })
+         check(queue.tryPop(value) && value == expected, "bulk elements popped out of order");
+
+      check(!queue.tryPop(value), "pop from an empty queue");
+   }
+
+   void wrapAround()
+   {
+      MpmcQueue<size_t> queue(4);
+      std::vector<size_t> values(3);
+      size_t next = 0;
+      size_t expected = 0;
+
+      // many laps over the ring, with bulk pushes straddling its end
+      for (size_t lap = 0; lap < 1000; ++lap)
+      {
+         for (auto& value : values)
+            value = next++;
+
+         check(queue.tryPushBulk(values.begin(), values.size()), "bulk push after wrapping around");
+
+         size_t value = 0;
+
+         for (size_t i = 0; i < values.size(); ++i)
+            check(queue.tryPop(value) && value == expected++, "value lost across the end of the ring");
+
+         size_t single = next++;
+         check(queue.tryPush(std::move(single)), "push after wrapping around");
+         check(queue.tryPop(value) && value == expected++, "value lost across the end of the ring");
+      }
+   }
+
+   void concurrent()
+   {
+      constexpr size_t Producers = 4;
+      constexpr size_t Consumers = 4;
+      constexpr size_t Bulks = 20000;
+      constexpr size_t BulkSize = 4;
+
+      // every producer has at most one bulk queued, so there is always room
+      MpmcQueue<size_t> queue(Producers * BulkSize);
+      std::atomic<size_t> spurious{ 0 };
+      std::atomic<size_t> popped{ 0 };
+      std::atomic<size_t> sum{ 0 };
+      std::vector<std::atomic<size_t>> pending(Producers);
+      std::vector<std::thread> threads;
+
+      for (size_t p = 0; p < Producers; ++p)
+      {
+         threads.emplace_back([&, p]
+         {
+            std::vector<size_t> values(BulkSize);
+
+            for (size_t i = 0; i < Bulks; ++i)
+            {
+               while (pending[p].load() > 0)
+                  std::this_thread::yield();
+
+               for (size_t j = 0; j < BulkSize; ++j)
+                  values[j] = (p * Bulks + i) * BulkSize + j;
+
+               pending[p].store(BulkSize);
+
+               if (!queue.tryPushBulk(values.begin(), values.size()))
+               {
+                  ++spurious;
+                  pending[p].store(0);
+               }
+            }
+         });
+      }
+
+      for (size_t c = 0; c < Consumers; ++c)
+      {
+         threads.emplace_back([&]
+         {
+            size_t value = 0;
+
+            while (popped.load() < Producers * Bulks * BulkSize - spurious.load() * BulkSize)
+            {
+               if (!queue.tryPop(value))
+               {
+                  std::this_thread::yield();
+                  continue;
+               }
+
+               sum += value;
+               --pending[value / (Bulks * BulkSize)];
+               ++popped;
+            }
+         });
+      }
+
+      for (auto& thread : threads)
+         thread.join();
+
+      size_t total = Producers * Bulks * BulkSize;
+      check(spurious.load() == 0, std::to_string(spurious.load()) + " bulk pushes failed on a queue with room");
+      check(popped.load() == total, "elements lost or duplicated");
+      check(sum.load() == total * (total - 1) / 2, "elements lost or duplicated");
+   }
+}
+
+int main()
+{
+   try
+   {
+      bulkAllOrNothing();
+      wrapAround();
+      concurrent();
+      std::cout << "MpmcQueue: ok\n";
+   }
+   catch (const std::exception& ex)
+   {
+      std::cerr << ex.what() << "\n";
+      return 1;
+   }
+
+   return 0;
+}
\ No newline at end of file
@@ -0,0 +1,121 @@
+// Checks RemoteServer and RemoteClient over loopback: pipelined requests
+// all get their own reply, replies come in completion order rather than
+// request order, and replies read aside by call() are handed to receive()
+// in the order they arrived.
+#include "Remote.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using namespace comp;
+
+namespace
+{
+   void check(bool condition, const std::string& what)
+   {
+      if (!condition)
+         throw std::runtime_error(what);
+   }
+
+   CommandStatus echo(const CommandArgs& args)
+   {
+      return CommandStatus(args.command(), CommandStatus::OK, args.getString("-v", ""));
+   }
+
+   CommandStatus sleep(const CommandArgs& args)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(args.getUInt("-ms")));
+      return CommandStatus(args.command(), CommandStatus::OK, "slept");
+   }
+
+   void pipelining(RemoteClient& client)
+   {
+      constexpr size_t Requests = 10000;
+      std::vector<std::string> values(Requests);
+
+      for (size_t i = 0; i < Requests; ++i)
+      {
+         uint64_t id = client.send({ "echo", "-v", std::to_string(i) });
+         values[id] = std::to_string(i);
+      }
+
+      std::set<uint64_t> seen;
+
+      for (size_t i = 0; i < Requests; ++i)
+      {
+         RemoteClient::Reply reply = client.receive();
+         check(reply.id < Requests && seen.insert(reply.id).second, "a pipelined request got no reply or several");
+         check(reply.statuses.size() == 1 && reply.statuses[0].msg == values[reply.id], "a reply does not belong to its request");
+      }
+   }
+
+   void completionOrder(RemoteClient& client)
+   {
+      uint64_t slow = client.send({ "sleep", "-ms", "100" });
+      uint64_t fast = client.send({ "echo", "-v", "fast" });
+
+      check(client.receive().id == fast, "a fast request waited for a slow one sent before it");
+      check(client.receive().id == slow, "the reply of a slow request was lost");
+   }
+
+   void earlyReplies(RemoteClient& client)
+   {
+      // the echoes share an ordering key, so they finish in request order while the sleep runs
+      uint64_t slow = client.send({ "sleep", "-ms", "100" });
+      std::vector<uint64_t> early;
+
+      for (int i = 0; i < 8; ++i)
+         early.push_back(client.send({ "echo", "-k", "early", "-v", std::to_string(i) }));
+
+      auto statuses = client.call({ "echo", "-k", "early", "-v", "call" });
+      check(statuses.size() == 1 && statuses[0].msg == "call", "call() returned the reply of another request");
+
+      for (uint64_t id : early)
+         check(client.receive().id == id, "replies read aside by call() came back out of arrival order");
+
+      check(client.receive().id == slow, "the reply of a slow request was lost");
+   }
+}
+
+int main()
+{
+   try
+   {
+      CommandConfig echoConfig("echo");
+      echoConfig.append(Option("-v").argSize(1));
+      echoConfig.append(Option("-k").argSize(1));
+      echoConfig.orderingKey("-k");
+
+      CommandConfig sleepConfig("sleep");
+      sleepConfig.append(Option("-ms").argSize(1));
+
+      Commander commander;
+      commander.appendCommand(CommandCaller(echo, echoConfig));
+      commander.appendCommand(CommandCaller(sleep, sleepConfig));
+      commander.start(2, 1024);
+
+      {
+         RemoteServer server(commander);
+         RemoteClient client(server.port());
+
+         pipelining(client);
+         completionOrder(client);
+         earlyReplies(client);
+         server.stop();
+      }
+
+      commander.stop();
+      std::cout << "remote: ok\n";
+   }
+   catch (const std::exception& ex)
+   {
+      std::cerr << ex.what() << "\n";
+      return 1;
+   }
+
+   return 0;
+}
\ No newline at end of file
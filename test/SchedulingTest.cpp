@@ -0,0 +1,292 @@
+// Checks the executor scheduling of Commander: ordering keys keep the
+// submission order, declared resources exclude writers from everything
+// else, maxConcurrency bounds the invocations running at once, and retries
+// of an idempotency key still running wait for that run.
+#include "CommandProcessor.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace comp;
+
+namespace
+{
+   constexpr size_t Workers = 4;
+
+   void check(bool condition, const std::string& what)
+   {
+      if (!condition)
+         throw std::runtime_error(what);
+   }
+
+   void submit(Commander& commander, const ArgVec& args, Commander::Completion done = nullptr)
+   {
+      while (!(done ? commander.submit(args, done) : commander.submit(args)))
+         std::this_thread::yield();
+   }
+
+   // raises peak to the number of callers inside the scope while it lives
+   class Occupancy
+   {
+   public:
+
+      Occupancy(std::atomic<int>& active, std::atomic<int>& peak) :
+         m_active(active)
+      {
+         int now = ++m_active;
+
+         for (int seen = peak.load(); now > seen && !peak.compare_exchange_weak(seen, now);)
+            ;
+      }
+
+      ~Occupancy()
+      {
+         --m_active;
+      }
+
+   private:
+
+      std::atomic<int>& m_active;
+   };
+
+   namespace ordering
+   {
+      constexpr unsigned Keys = 4;
+
+      std::mutex mutex;
+      std::map<unsigned, std::vector<unsigned>> seen;
+      std::atomic<int> active[Keys];
+      std::atomic<int> overlaps{ 0 };
+
+      CommandStatus append(const CommandArgs& args)
+      {
+         unsigned key = args.getUInt("-k");
+
+         if (active[key]++ != 0)
+            ++overlaps;
+
+         std::this_thread::sleep_for(std::chrono::microseconds(50));
+
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            seen[key].push_back(args.getUInt("-s"));
+         }
+
+         --active[key];
+         return CommandStatus("append");
+      }
+
+      void run()
+      {
+         CommandConfig config("append");
+         config.append(Option("-k").argSize(1));
+         config.append(Option("-s").argSize(1));
+         config.orderingKey("-k");
+
+         Commander commander;
+         commander.appendCommand(CommandCaller(append, config));
+         commander.start(Workers, 64);
+
+         for (unsigned i = 0; i < 2000; ++i)
+            submit(commander, { "append", "-k", std::to_string(i % Keys), "-s", std::to_string(i) });
+
+         commander.stop();
+
+         size_t total = 0;
+
+         for (auto const& key : seen)
+         {
+            total += key.second.size();
+
+            for (size_t i = 1; i < key.second.size(); ++i)
+               check(key.second[i - 1] < key.second[i], "commands of one ordering key ran out of submission order");
+         }
+
+         check(total == 2000, "commands of ordering keys were lost");
+         check(overlaps.load() == 0, "commands of one ordering key ran at the same time");
+      }
+   }
+
+   namespace resources
+   {
+      std::atomic<int> readers{ 0 };
+      std::atomic<int> writers{ 0 };
+      std::atomic<int> peakReaders{ 0 };
+      std::atomic<int> violations{ 0 };
+      std::atomic<int> writes{ 0 };
+
+      CommandStatus read(const CommandArgs&)
+      {
+         Occupancy occupancy(readers, peakReaders);
+
+         if (writers.load() != 0)
+            ++violations;
+
+         std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+         if (writers.load() != 0)
+            ++violations;
+
+         return CommandStatus("read");
+      }
+
+      CommandStatus write(const CommandArgs&)
+      {
+         if (writers++ != 0 || readers.load() != 0)
+            ++violations;
+
+         std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+         if (readers.load() != 0)
+            ++violations;
+
+         --writers;
+         ++writes;
+         return CommandStatus("write");
+      }
+
+      void run()
+      {
+         Commander commander;
+         commander.appendCommand(CommandCaller(read, CommandConfig("read").reads("table")));
+         commander.appendCommand(CommandCaller(write, CommandConfig("write").writes("table")));
+         commander.start(Workers, 64);
+
+         for (unsigned i = 0; i < 1000; ++i)
+            submit(commander, { i % 10 == 0 ? "write" : "read" });
+
+         commander.stop();
+
+         check(violations.load() == 0, "a writer ran alongside another command on its resource");
+         check(writes.load() == 100, "writers were lost");
+         check(peakReaders.load() > 1, "readers of a resource never ran at the same time");
+      }
+   }
+
+   namespace limit
+   {
+      constexpr int MaxConcurrency = 2;
+
+      std::atomic<int> active{ 0 };
+      std::atomic<int> peak{ 0 };
+      std::atomic<int> calls{ 0 };
+
+      CommandStatus work(const CommandArgs&)
+      {
+         Occupancy occupancy(active, peak);
+         std::this_thread::sleep_for(std::chrono::microseconds(200));
+         ++calls;
+         return CommandStatus("work");
+      }
+
+      void run()
+      {
+         Commander commander;
+         commander.appendCommand(CommandCaller(work, CommandConfig("work").maxConcurrency(MaxConcurrency)));
+         commander.start(Workers, 64);
+
+         for (unsigned i = 0; i < 500; ++i)
+            submit(commander, { "work" });
+
+         commander.stop();
+
+         check(calls.load() == 500, "limited commands were lost");
+         check(peak.load() <= MaxConcurrency, "maxConcurrency was exceeded, " + std::to_string(peak.load()) + " ran at once");
+         check(peak.load() == MaxConcurrency, "limited commands never ran at the same time");
+      }
+   }
+
+   namespace idempotency
+   {
+      std::atomic<int> calls{ 0 };
+      std::atomic<bool> release{ false };
+
+      CommandStatus pay(const CommandArgs& args)
+      {
+         int call = ++calls;
+
+         while (!release.load())
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+         return CommandStatus("pay", CommandStatus::OK, "paid " + args.getString("--id") + " by run " + std::to_string(call));
+      }
+
+      void run()
+      {
+         CommandConfig config("pay");
+         config.append(Option("--id").argSize(1));
+         config.idempotencyKey("--id");
+
+         Commander commander;
+         commander.appendCommand(CommandCaller(pay, config));
+         commander.setIdempotency(100, std::chrono::milliseconds(60000));
+         commander.start(Workers, 64);
+
+         std::mutex mutex;
+         std::vector<std::string> replies;
+
+         auto done = [&mutex, &replies](std::vector<CommandStatus>& statuses)
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            replies.push_back(statuses.size() == 1 ? statuses.front().msg : "");
+         };
+
+         submit(commander, { "pay", "--id", "a" }, done);
+
+         while (calls.load() == 0)
+            std::this_thread::yield();
+
+         // retries arriving while the first run is in flight, more than there are workers
+         for (size_t i = 0; i < 2 * Workers; ++i)
+            submit(commander, { "pay", "--id", "a" }, done);
+
+         std::this_thread::sleep_for(std::chrono::milliseconds(20));
+         release = true;
+
+         auto answered = [&mutex, &replies]
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            return replies.size();
+         };
+
+         while (answered() < 2 * Workers + 1)
+            std::this_thread::yield();
+
+         // a retry after the run returned gets the cached status
+         submit(commander, { "pay", "--id", "a" }, done);
+         commander.stop();
+
+         check(calls.load() == 1, "retries of an idempotency key ran " + std::to_string(calls.load()) + " times");
+         check(replies.size() == 2 * Workers + 2, "retries of an idempotency key were lost");
+
+         for (auto const& reply : replies)
+            check(reply == "paid a by run 1", "a retry reported \"" + reply + "\" instead of the status of the first run");
+      }
+   }
+}
+
+int main()
+{
+   try
+   {
+      ordering::run();
+      resources::run();
+      limit::run();
+      idempotency::run();
+      std::cout << "scheduling: ok\n";
+   }
+   catch (const std::exception& ex)
+   {
+      std::cerr << ex.what() << "\n";
+      return 1;
+   }
+
+   return 0;
+}
\ No newline at end of file
@@ -0,0 +1,172 @@
+// Checks the recovery of WriteAheadLog: reopening a log continues its
+// sequence numbers, a torn tail is cut off, frames larger than a read
+// chunk survive, and a log whose writes failed drops later records while
+// the next open carries on from the last complete batch.
+#include "WriteAheadLog.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+using namespace comp;
+
+namespace
+{
+   const std::string Path = "WriteAheadLogTest.log";
+
+   void check(bool condition, const std::string& what)
+   {
+      if (!condition)
+         throw std::runtime_error(what);
+   }
+
+   std::vector<uint64_t> sequences()
+   {
+      std::vector<uint64_t> res;
+      WriteAheadLog::replay(Path, [&res](const WriteAheadLog::Record& record) { res.push_back(record.sequence); });
+      return res;
+   }
+
+   uint64_t fileSize()
+   {
+      struct stat info;
+      check(stat(Path.c_str(), &info) == 0, "cannot stat the log");
+      return static_cast<uint64_t>(info.st_size);
+   }
+
+   void continues()
+   {
+      {
+         WriteAheadLog log(Path);
+         log.result(log.command({ "a" }), 1, "a", "");
+      }
+
+      {
+         WriteAheadLog log(Path);
+         log.result(log.command({ "b" }), 1, "b", "");
+      }
+
+      check(sequences() == std::vector<uint64_t>({ 0, 1, 2, 3 }), "reopening the log did not continue its sequence numbers");
+   }
+
+   void tornTail()
+   {
+      uint64_t intact = fileSize();
+
+      // a header announcing more payload than was written
+      FILE* file = std::fopen(Path.c_str(), "ab");
+      std::fwrite("\x20\0\0\0abc", 1, 7, file);
+      std::fclose(file);
+
+      {
+         WriteAheadLog log(Path);
+         check(fileSize() == intact, "the torn tail was not cut off");
+         check(log.command({ "c" }) == 4, "the record after a torn tail did not continue the numbering");
+      }
+
+      check(sequences() == std::vector<uint64_t>({ 0, 1, 2, 3, 4 }), "records were lost around the torn tail");
+   }
+
+   void largeFrames()
+   {
+      // frames crossing several read chunks
+      std::string large(200 << 10, 'x');
+
+      {
+         WriteAheadLog log(Path);
+         log.command({ "large", large });
+         log.command({ "d" });
+      }
+
+      std::vector<std::string> last;
+
+      WriteAheadLog::replay(Path, [&last](const WriteAheadLog::Record& record)
+      {
+         if (record.type == WriteAheadLog::Record::Command)
+            last = record.args;
+      });
+
+      check(sequences() == std::vector<uint64_t>({ 0, 1, 2, 3, 4, 5, 6 }), "records were lost around a large frame");
+      check(last == std::vector<std::string>({ "d" }), "the record after a large frame was not intact");
+   }
+
+   void failure()
+   {
+      std::signal(SIGXFSZ, SIG_IGN);
+      rlimit limit;
+      check(getrlimit(RLIMIT_FSIZE, &limit) == 0, "cannot read the file size limit");
+      rlim_t soft = limit.rlim_cur;
+
+      {
+         WriteAheadLog log(Path, std::chrono::microseconds(100), 1);
+
+         // room for about one record
+         limit.rlim_cur = static_cast<rlim_t>(fileSize() + 40);
+         check(setrlimit(RLIMIT_FSIZE, &limit) == 0, "cannot lower the file size limit");
+
+         for (int i = 0; i < 10; ++i)
+         {
+            log.command({ "xxxxxxxxxxxxxxxx" });
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+         }
+
+         limit.rlim_cur = soft;
+         check(setrlimit(RLIMIT_FSIZE, &limit) == 0, "cannot restore the file size limit");
+         check(log.failed(), "a write past the file size limit did not fail the log");
+
+         bool thrown = false;
+
+         try
+         {
+            log.sync();
+         }
+         catch (const std::runtime_error&)
+         {
+            thrown = true;
+         }
+
+         check(thrown, "sync() of a failed log did not throw");
+      }
+
+      std::vector<uint64_t> before = sequences();
+
+      {
+         WriteAheadLog log(Path);
+         log.command({ "e" });
+      }
+
+      std::vector<uint64_t> after = sequences();
+      check(after.size() == before.size() + 1 && after.back() == before.back() + 1,
+         "the log did not carry on from its last complete batch after a failure");
+   }
+}
+
+int main()
+{
+   std::remove(Path.c_str());
+
+   try
+   {
+      continues();
+      tornTail();
+      largeFrames();
+      failure();
+      std::remove(Path.c_str());
+      std::cout << "WriteAheadLog: ok\n";
+   }
+   catch (const std::exception& ex)
+   {
+      std::cerr << ex.what() << "\n";
+      return 1;
+   }
+
+   return 0;
+}
\ No newline at end of file